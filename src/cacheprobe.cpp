@@ -0,0 +1,85 @@
+#include "cacheprobe.h"
+
+#include <QRegularExpression>
+
+#include "compilecache.h"
+#include "compileworker.h"
+#include "coordinateparser.h"
+#include "latencytracker.h"
+
+cacheprobe::cacheprobe(QObject *parent) : QObject(parent) {}
+
+void cacheprobe::probe(quint64 generation,
+                       const QString &source_text,
+                       const QString &compiler_command,
+                       int grid_step_mm,
+                       int grid_extent_cm) {
+    const QString document_text = inject_calibration(inject_grid(source_text, grid_step_mm, grid_extent_cm));
+    emit phase_reached(generation, static_cast<int>(latency_phase::inject), latencytracker::now_us());
+    const QString key = compilecache::key(document_text, compiler_command);
+    QString pdf_path;
+    QString log_path;
+    if (compilecache::lookup(key, pdf_path, log_path)) {
+        emit cache_hit(generation, pdf_path, compileworker::read_page_anchors(log_path), key);
+        return;
+    }
+    emit cache_miss(generation, document_text, compiler_command, key);
+}
+
+QString cacheprobe::inject_grid(const QString &source, int grid_step_mm, int grid_extent_cm) {
+    static const QRegularExpression begin_tikz_pattern(R"(\\begin\{tikzpicture\}(?:\[[^\]]*\])?)");
+    const QRegularExpressionMatch begin_match = begin_tikz_pattern.match(source);
+    if (grid_step_mm <= 0 || !begin_match.hasMatch()) {
+        return source;
+    }
+
+    // Drawn first so the picture covers it, in the colors the canvas uses for its own grid.
+    const QString step = coordinateparser::format_number(static_cast<double>(grid_step_mm) / 10.0);
+    const double half = static_cast<double>(qBound(20, grid_extent_cm, 100)) / 2.0;
+    const QString low = coordinateparser::format_number(-half);
+    const QString high = coordinateparser::format_number(half);
+    QString grid_block = "\n  % ktikz preview grid\n";
+    if (grid_step_mm != 10) {
+        grid_block += "  \\draw[step=" + step + ", gray!18, very thin] (" + low + "," + low + ") grid (" + high + "," +
+                      high + ");\n";
+    }
+    grid_block += "  \\draw[step=1, gray!38, thin] (" + low + "," + low + ") grid (" + high + "," + high + ");\n";
+    grid_block += "  \\draw[gray!50, thin] (" + low + ",0) -- (" + high + ",0);\n";
+    grid_block += "  \\draw[gray!50, thin] (0," + low + ") -- (0," + high + ");\n";
+
+    QString out = source;
+    out.insert(begin_match.capturedEnd(0), grid_block);
+    return out;
+}
+
+QString cacheprobe::inject_calibration(const QString &source) {
+    const int end_pos = source.lastIndexOf("\\end{tikzpicture}");
+    if (end_pos < 0 || !source.contains("\\begin{tikzpicture}")) {
+        return source;
+    }
+
+    // Engines with savepos support write the exact page position of (0,0), (1,0) and (0,1) to the log
+    // at shipout; the colored dots are only drawn as a pixel calibration fallback for the others.
+    QString marker_block;
+    marker_block += "\n  % ktikz calibration anchors\n";
+    marker_block += "  \\ifdefined\\pdfsavepos\\global\\let\\ktikzsavepos\\pdfsavepos"
+                    "\\global\\let\\ktikzlastxpos\\pdflastxpos\\global\\let\\ktikzlastypos\\pdflastypos\n";
+    marker_block += "  \\else\\ifdefined\\savepos\\global\\let\\ktikzsavepos\\savepos"
+                    "\\global\\let\\ktikzlastxpos\\lastxpos\\global\\let\\ktikzlastypos\\lastypos\\fi\\fi\n";
+    marker_block += "  \\ifdefined\\ktikzsavepos\n";
+    const char *anchors[3][2] = {{"o", "0,0"}, {"x", "1,0"}, {"y", "0,1"}};
+    for (const auto &anchor : anchors) {
+        marker_block += QString("  \\node[inner sep=0pt,outer sep=0pt,anchor=base west] at (") + anchor[1] +
+                        ") {\\ktikzsavepos\\write-1{ktikz-anchor " + anchor[0] +
+                        " \\the\\ktikzlastxpos\\space\\the\\ktikzlastypos}};\n";
+    }
+    marker_block += "  \\else\n";
+    marker_block += "  \\fill[draw=none,fill={rgb,255:red,253;green,17;blue,251}] (0,0) circle[radius=2.0pt];\n";
+    marker_block += "  \\fill[draw=none,fill={rgb,255:red,19;green,251;blue,233}] (1,0) circle[radius=2.0pt];\n";
+    marker_block += "  \\fill[draw=none,fill={rgb,255:red,13;green,97;blue,255}] (0,1) circle[radius=2.0pt];\n";
+    marker_block += "  \\fi\n";
+
+    QString out = source;
+    out.insert(end_pos, marker_block);
+    return out;
+}
@@ -0,0 +1,42 @@
+#ifndef CACHEPROBE_H
+#define CACHEPROBE_H
+
+#include <QObject>
+#include <QString>
+
+#include "model.h"
+
+// Prepares each compile request on a background thread: injects the calibration anchors, hashes
+// the document and looks it up in the compile cache, so the GUI thread never touches the source
+// text or the cache files.
+class cacheprobe : public QObject {
+    Q_OBJECT
+
+public:
+    explicit cacheprobe(QObject *parent = nullptr);
+
+public slots:
+    // A positive grid_step_mm also draws the grid into the picture, for previews the canvas
+    // cannot calibrate and so cannot draw it over.
+    void probe(quint64 generation,
+               const QString &source_text,
+               const QString &compiler_command,
+               int grid_step_mm,
+               int grid_extent_cm);
+
+signals:
+    void phase_reached(quint64 generation, int phase, qint64 timestamp_us);
+    // The entry is pinned for the receiver to release; see compilecache::release().
+    void cache_hit(quint64 generation, const QString &pdf_path, const page_anchors &anchors, const QString &key);
+    // The document to compile, with the command it was keyed for and its cache key.
+    void cache_miss(quint64 generation,
+                    const QString &document_text,
+                    const QString &compiler_command,
+                    const QString &key);
+
+private:
+    static QString inject_grid(const QString &source, int grid_step_mm, int grid_extent_cm);
+    static QString inject_calibration(const QString &source);
+};
+
+#endif
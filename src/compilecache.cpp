@@ -0,0 +1,142 @@
+#include "compilecache.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStandardPaths>
+#include <QUuid>
+#include <filesystem>
+#include <system_error>
+
+namespace {
+
+// Cached PDFs and logs are evicted oldest-first once their total size exceeds this budget.
+constexpr qint64 cache_budget_bytes = 256LL * 1024 * 1024;
+
+// Entries handed to the preview, with the number of holders; eviction spares them until released.
+// Pinning and eviction hold the mutex, so an entry is never removed between check and pin.
+QMutex pinned_mutex;
+QHash<QString, int> pinned_keys;
+
+} // namespace
+
+bool compilecache::place_file(const QString &source, const QString &target, bool overwrite) {
+    if (!overwrite && QFileInfo::exists(target)) {
+        return true;
+    }
+    const QString temp_path = target + ".part-" + QUuid::createUuid().toString(QUuid::Id128);
+    if (!QFile::copy(source, temp_path)) {
+        QFile::remove(temp_path);
+        return false;
+    }
+    if (overwrite) {
+        // A single rename replaces the target, so readers see either the old or the new file.
+        std::error_code error;
+        std::filesystem::rename(std::filesystem::path(temp_path.toStdU16String()),
+                                std::filesystem::path(target.toStdU16String()),
+                                error);
+        if (error) {
+            QFile::remove(temp_path);
+            return false;
+        }
+        return true;
+    }
+    if (!QFile::rename(temp_path, target)) {
+        QFile::remove(temp_path);
+        return QFileInfo::exists(target);
+    }
+    return true;
+}
+
+QString compilecache::directory() {
+    static const QString dir_path = []() {
+        const QString base = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+        if (base.isEmpty() || !QDir().mkpath(base + "/compile")) {
+            return QString();
+        }
+        return base + "/compile";
+    }();
+    return dir_path;
+}
+
+QString compilecache::key(const QString &document_text, const QString &compiler_command) {
+    const QByteArray input = (compiler_command + '\n' + document_text).toUtf8();
+    return QString::fromLatin1(QCryptographicHash::hash(input, QCryptographicHash::Sha256).toHex());
+}
+
+bool compilecache::lookup(const QString &key, QString &pdf_path_out, QString &log_path_out) {
+    const QString dir_path = directory();
+    if (dir_path.isEmpty() || key.isEmpty()) {
+        return false;
+    }
+    const QString pdf_path = dir_path + "/" + key + ".pdf";
+    const QString log_path = dir_path + "/" + key + ".log";
+    {
+        const QMutexLocker locker(&pinned_mutex);
+        if (!QFileInfo::exists(pdf_path) || !QFileInfo::exists(log_path)) {
+            return false;
+        }
+        ++pinned_keys[key];
+    }
+
+    // Touch the entry so eviction keeps recently used documents.
+    QFile pdf_file(pdf_path);
+    if (pdf_file.open(QIODevice::ReadWrite)) {
+        pdf_file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        pdf_file.close();
+    }
+    pdf_path_out = pdf_path;
+    log_path_out = log_path;
+    return true;
+}
+
+bool compilecache::store(const QString &key, const QString &pdf_path, const QString &log_path, QString &cached_pdf_out) {
+    const QString dir_path = directory();
+    if (dir_path.isEmpty() || key.isEmpty()) {
+        return false;
+    }
+    const QString cached_pdf = dir_path + "/" + key + ".pdf";
+    const QString cached_log = dir_path + "/" + key + ".log";
+    // Identical content compiles to an identical entry, so an existing one is kept as is. The log
+    // is placed first: an entry only counts as present once its PDF exists.
+    const bool present = QFileInfo::exists(cached_pdf) && QFileInfo::exists(cached_log);
+    if (!present && (!place_file(log_path, cached_log, false) || !place_file(pdf_path, cached_pdf, false))) {
+        return false;
+    }
+    const QMutexLocker locker(&pinned_mutex);
+    if (!QFileInfo::exists(cached_pdf)) {
+        return false;
+    }
+    ++pinned_keys[key];
+    evict(dir_path);
+    cached_pdf_out = cached_pdf;
+    return true;
+}
+
+void compilecache::release(const QString &key) {
+    const QMutexLocker locker(&pinned_mutex);
+    const auto it = pinned_keys.find(key);
+    if (it != pinned_keys.end() && --it.value() <= 0) {
+        pinned_keys.erase(it);
+    }
+}
+
+void compilecache::evict(const QString &dir_path) {
+    const QDir dir(dir_path);
+    const QFileInfoList entries = dir.entryInfoList(QStringList() << "*.pdf", QDir::Files, QDir::Time);
+    qint64 total = 0;
+    for (const QFileInfo &entry : entries) {
+        const QString entry_key = entry.completeBaseName();
+        const QString log_path = dir_path + "/" + entry_key + ".log";
+        total += entry.size() + QFileInfo(log_path).size();
+        if (total > cache_budget_bytes && !pinned_keys.contains(entry_key)) {
+            QFile::remove(entry.absoluteFilePath());
+            QFile::remove(log_path);
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef COMPILECACHE_H
+#define COMPILECACHE_H
+
+#include <QString>
+
+// Content-addressed store of compiled PDFs and their logs, keyed by the hash of the compiled
+// document and compiler command. Safe to use from any thread.
+class compilecache {
+public:
+    static QString key(const QString &document_text, const QString &compiler_command);
+    // A successful lookup or store pins the entry against eviction until release() is called for
+    // it, so a PDF handed to the preview stays readable while it loads and is shown.
+    static bool lookup(const QString &key, QString &pdf_path_out, QString &log_path_out);
+    static bool store(const QString &key, const QString &pdf_path, const QString &log_path, QString &cached_pdf_out);
+    static void release(const QString &key);
+    // Copies source to target through a temporary file renamed into place, so readers never see
+    // a partial file. An existing target is replaced when overwrite is set and kept otherwise.
+    static bool place_file(const QString &source, const QString &target, bool overwrite);
+
+private:
+    static QString directory();
+    // Called with the pins locked.
+    static void evict(const QString &dir_path);
+};
+
+#endif
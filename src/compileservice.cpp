@@ -1,20 +1,69 @@
 #include "compileservice.h"
 
-#include <QDateTime>
-#include <QFile>
-#include <QProcessEnvironment>
-#include <QRegularExpression>
-#include <QTemporaryDir>
-#include <QTextStream>
+#include "cacheprobe.h"
+#include "compilecache.h"
+#include "compileworker.h"
+
+namespace {
+
+// A running job is left to finish when it has used this fraction of the average compile time.
+constexpr double near_done_fraction = 0.7;
+// Idle standby compilers kept by all workers together. Requests go to the first idle worker, so
+// the standbys are kept by the first workers, which take nearly every request.
+constexpr int standby_total_limit = 2;
+
+} // namespace
 
 compileservice::compileservice(QObject *parent) : QObject(parent) {
-    connect(&proc_, &QProcess::readyReadStandardOutput, this, &compileservice::on_ready_output);
-    connect(&proc_, &QProcess::readyReadStandardError, this, &compileservice::on_ready_output);
-    connect(&proc_, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), this, &compileservice::on_finished);
+    const int worker_count = qBound(2, QThread::idealThreadCount() / 2, 4);
+    for (int i = 0; i < worker_count; ++i) {
+        worker_slot slot;
+        // A worker blocks its thread while it writes files or reads the cache, so workers do not share one.
+        slot.thread = new QThread(this);
+        slot.worker = new compileworker;
+        if (format_dir_.isValid()) {
+            slot.worker->set_format_dir(format_dir_.path());
+        }
+        slot.worker->set_standby_limit(i < standby_total_limit ? 1 : 0);
+        slot.worker->moveToThread(slot.thread);
+        connect(slot.thread, &QThread::finished, slot.worker, &QObject::deleteLater);
+        connect(slot.worker, &compileworker::output_text, this, &compileservice::on_worker_output);
+        connect(slot.worker, &compileworker::phase_reached, this, &compileservice::phase_reached);
+        connect(slot.worker, &compileworker::job_finished, this, &compileservice::on_job_finished);
+        slot.thread->start();
+        workers_.push_back(slot);
+    }
+
+    probe_ = new cacheprobe;
+    probe_->moveToThread(&probe_thread_);
+    connect(&probe_thread_, &QThread::finished, probe_, &QObject::deleteLater);
+    connect(probe_, &cacheprobe::phase_reached, this, &compileservice::phase_reached);
+    connect(probe_, &cacheprobe::cache_hit, this, &compileservice::on_cache_hit);
+    connect(probe_, &cacheprobe::cache_miss, this, &compileservice::on_cache_miss);
+    probe_thread_.start();
+}
+
+compileservice::~compileservice() {
+    probe_thread_.quit();
+    for (const worker_slot &slot : workers_) {
+        slot.thread->quit();
+    }
+    for (const worker_slot &slot : workers_) {
+        slot.thread->wait();
+    }
+    probe_thread_.wait();
 }
 
 bool compileservice::is_busy() const {
-    return proc_.state() != QProcess::NotRunning;
+    if (probes_in_flight_ > 0 || has_pending_) {
+        return true;
+    }
+    for (const worker_slot &slot : workers_) {
+        if (slot.busy) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void compileservice::set_compiler_command(const QString &command) {
@@ -26,144 +75,183 @@ QString compileservice::compiler_command() const {
     return compiler_command_;
 }
 
+void compileservice::set_source_grid(int step_mm, int extent_cm) {
+    source_grid_step_mm_ = qMax(0, step_mm);
+    source_grid_extent_cm_ = extent_cm;
+}
+
+double compileservice::average_compile_ms() const {
+    return average_compile_ms_;
+}
+
 void compileservice::cancel() {
-    if (!is_busy()) {
-        return;
-    }
-    canceled_ = true;
-    proc_.kill();
+    // Requests still being probed are dropped when their result arrives.
+    canceled_generation_ = next_generation_;
+    cancel_older(next_generation_ + 1);
 }
 
-bool compileservice::ensure_work_dir() {
-    if (!work_dir_path_.isEmpty()) {
-        return true;
+void compileservice::cancel_older(quint64 generation) {
+    if (pending_generation_ < generation) {
+        has_pending_ = false;
     }
-    temp_dir_ = std::make_unique<QTemporaryDir>();
-    if (!temp_dir_->isValid()) {
-        return false;
+    for (worker_slot &slot : workers_) {
+        if (slot.busy && slot.generation < generation && !slot.cancel_requested) {
+            slot.cancel_requested = true;
+            cancel_job(slot);
+        }
     }
-    work_dir_path_ = temp_dir_->path();
-    return true;
 }
 
-QString compileservice::format_step(double step) {
-    QString s = QString::number(step, 'f', 4);
-    while (s.contains('.') && (s.endsWith('0') || s.endsWith('.'))) {
-        s.chop(1);
-    }
-    return s;
+void compileservice::cancel_job(const worker_slot &slot) {
+    const quint64 generation = slot.generation;
+    QMetaObject::invokeMethod(
+        slot.worker, [worker = slot.worker, generation]() { worker->cancel(generation); }, Qt::QueuedConnection);
 }
 
-QString compileservice::inject_grid(const QString &source, int grid_step_mm, int grid_extent_cm) {
-    static const QRegularExpression begin_tikz_pattern(R"(\\begin\{tikzpicture\}(?:\[[^\]]*\])?)");
-    static const QRegularExpression end_tikz_pattern(R"(\\end\{tikzpicture\})");
+quint64 compileservice::compile(const QString &source_text) {
+    const quint64 generation = ++next_generation_;
+    ++probes_in_flight_;
+    QMetaObject::invokeMethod(
+        probe_,
+        [probe = probe_,
+         generation,
+         source_text,
+         command = compiler_command_,
+         step_mm = source_grid_step_mm_,
+         extent_cm = source_grid_extent_cm_]() { probe->probe(generation, source_text, command, step_mm, extent_cm); },
+        Qt::QueuedConnection);
+    return generation;
+}
 
-    const QRegularExpressionMatch begin_match = begin_tikz_pattern.match(source);
-    const QRegularExpressionMatch end_match = end_tikz_pattern.match(source);
-    if (!begin_match.hasMatch() || !end_match.hasMatch()) {
-        return source;
+void compileservice::on_cache_hit(quint64 generation,
+                                  const QString &pdf_path,
+                                  const page_anchors &anchors,
+                                  const QString &key) {
+    --probes_in_flight_;
+    if (generation <= canceled_generation_) {
+        compilecache::release(key);
+        return;
     }
-
-    const bool draw_grid = grid_step_mm > 0;
-    const QString step_expr = draw_grid ? format_step(static_cast<double>(grid_step_mm) / 10.0) : QStringLiteral("1");
-    const int clamped_extent = qBound(20, grid_extent_cm, 100);
-    const double half = static_cast<double>(clamped_extent) / 2.0;
-    const QString min_xy = format_step(-half);
-    const QString max_xy = format_step(half);
-
-    QString grid_block = "\n  % ktikz preview grid\n";
-    if (draw_grid) {
-        if (grid_step_mm != 10) {
-            grid_block += "  \\draw[step=" + step_expr + ", gray!18, very thin] (" + min_xy + "," + min_xy + ") grid (" + max_xy + "," + max_xy + ");\n";
-        }
-        grid_block += "  \\draw[step=1, gray!38, thin] (" + min_xy + "," + min_xy + ") grid (" + max_xy + "," + max_xy + ");\n";
-        grid_block += "  \\draw[gray!50, thin] (" + min_xy + ",0) -- (" + max_xy + ",0);\n";
-        grid_block += "  \\draw[gray!50, thin] (0," + min_xy + ") -- (0," + max_xy + ");\n";
+    // Anything still compiling is older than this result and would never be shown.
+    cancel_older(generation);
+    if (generation <= shown_generation_) {
+        compilecache::release(key);
+        return;
     }
+    shown_generation_ = generation;
+    handed_keys_[generation] = key;
+    emit output_text("[Preview] PDF updated (cached)");
+    emit compile_finished(generation, true, pdf_path, "ok", anchors);
+}
 
-    QString marker_block;
-    marker_block += "\n  % ktikz calibration markers (top layer)\n";
-    marker_block += "  \\fill[draw=none,fill={rgb,255:red,253;green,17;blue,251}] (0,0) circle[radius=2.0pt];\n";
-    marker_block += "  \\fill[draw=none,fill={rgb,255:red,19;green,251;blue,233}] (1,0) circle[radius=2.0pt];\n";
-    marker_block += "  \\fill[draw=none,fill={rgb,255:red,13;green,97;blue,255}] (0,1) circle[radius=2.0pt];\n";
-
-    QString out = source;
-    out.insert(begin_match.capturedEnd(0), grid_block);
-    const int end_pos = out.lastIndexOf("\\end{tikzpicture}");
-    if (end_pos >= 0) {
-        out.insert(end_pos, marker_block);
+void compileservice::preview_shown(quint64 generation) {
+    // The preview has dropped every older document, and results older than this one never load.
+    const auto shown = handed_keys_.lower_bound(generation);
+    for (auto it = handed_keys_.begin(); it != shown; ++it) {
+        compilecache::release(it->second);
     }
-    return out;
+    handed_keys_.erase(handed_keys_.begin(), shown);
 }
 
-void compileservice::compile(const QString &source_text, int grid_step_mm, int grid_extent_cm) {
-    if (is_busy()) {
-        emit output_text("[Compile] Already running");
+void compileservice::on_cache_miss(quint64 generation,
+                                   const QString &document_text,
+                                   const QString &compiler_command,
+                                   const QString &key) {
+    --probes_in_flight_;
+    if (generation <= canceled_generation_) {
         return;
     }
-    canceled_ = false;
 
-    if (!ensure_work_dir()) {
-        emit output_text("[Compile] Could not create temporary directory");
-        emit compile_finished(false, QString(), "workdir creation failed");
+    // Only the newest request is kept waiting; an older pending one would be superseded anyway.
+    pending_text_ = document_text;
+    pending_command_ = compiler_command;
+    pending_key_ = key;
+    pending_generation_ = generation;
+    has_pending_ = true;
+    dispatch_pending();
+    if (!has_pending_) {
         return;
     }
 
-    QFile tex_file(work_dir_path_ + "/document.tex");
-    if (!tex_file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
-        emit output_text("[Compile] Could not write document.tex");
-        emit compile_finished(false, QString(), "write failed");
-        return;
+    // Every worker is busy. Cancel the oldest job that is not close to done; its worker then
+    // takes the pending request. Jobs close to done are left to finish.
+    worker_slot *victim = nullptr;
+    for (worker_slot &slot : workers_) {
+        if (!slot.busy || slot.cancel_requested ||
+            (average_compile_ms_ > 0.0 && slot.started.elapsed() >= near_done_fraction * average_compile_ms_)) {
+            continue;
+        }
+        if (victim == nullptr || slot.generation < victim->generation) {
+            victim = &slot;
+        }
     }
+    if (victim != nullptr) {
+        victim->cancel_requested = true;
+        cancel_job(*victim);
+    }
+}
 
-    QTextStream out(&tex_file);
-    out << inject_grid(source_text, grid_step_mm, grid_extent_cm);
-    tex_file.close();
-
-    emit output_text("\n[Compile] " + QDateTime::currentDateTime().toString(Qt::ISODate));
-    emit output_text("[Compile] Running " + compiler_command_ + "...");
-
-    proc_.setWorkingDirectory(work_dir_path_);
-    proc_.setProcessEnvironment(QProcessEnvironment::systemEnvironment());
-    QStringList command_parts = QProcess::splitCommand(compiler_command_);
-    QString program = QStringLiteral("pdflatex");
-    if (!command_parts.isEmpty()) {
-        program = command_parts.takeFirst();
+void compileservice::dispatch_pending() {
+    if (!has_pending_) {
+        return;
     }
-    command_parts << "-interaction=nonstopmode" << "-halt-on-error" << "-file-line-error" << "document.tex";
-    proc_.start(program, command_parts);
-    if (!proc_.waitForStarted(1500)) {
-        emit output_text("[Error] Unable to start compiler: " + compiler_command_);
-        emit compile_finished(false, QString(), "start failed");
+    for (worker_slot &slot : workers_) {
+        if (slot.busy) {
+            continue;
+        }
+        has_pending_ = false;
+        slot.busy = true;
+        slot.cancel_requested = false;
+        slot.generation = pending_generation_;
+        slot.started.start();
+        QMetaObject::invokeMethod(
+            slot.worker,
+            [worker = slot.worker,
+             generation = pending_generation_,
+             text = pending_text_,
+             command = pending_command_,
+             key = pending_key_]() { worker->start(generation, text, command, key); },
+            Qt::QueuedConnection);
+        return;
     }
 }
 
-void compileservice::on_ready_output() {
-    const QByteArray std_out = proc_.readAllStandardOutput();
-    const QByteArray std_err = proc_.readAllStandardError();
-    if (!std_out.isEmpty()) {
-        emit output_text(QString::fromLocal8Bit(std_out));
-    }
-    if (!std_err.isEmpty()) {
-        emit output_text(QString::fromLocal8Bit(std_err));
+void compileservice::on_worker_output(quint64 generation, const QString &text) {
+    // Output of older jobs that were left running would interleave with the newest one.
+    if (generation == next_generation_) {
+        emit output_text(text);
     }
 }
 
-void compileservice::on_finished(int exit_code, QProcess::ExitStatus status) {
-    if (canceled_) {
-        canceled_ = false;
-        emit output_text("[Compile] Canceled");
-        emit compile_finished(false, QString(), "canceled");
-        return;
+void compileservice::on_job_finished(quint64 generation,
+                                     bool success,
+                                     const QString &pdf_path,
+                                     const QString &message,
+                                     const page_anchors &anchors,
+                                     qint64 elapsed_ms,
+                                     const QString &pinned_key) {
+    for (worker_slot &slot : workers_) {
+        if (slot.busy && slot.generation == generation) {
+            slot.busy = false;
+            slot.cancel_requested = false;
+            break;
+        }
+    }
+    if (success) {
+        const double duration = static_cast<double>(elapsed_ms);
+        average_compile_ms_ = average_compile_ms_ > 0.0 ? 0.8 * average_compile_ms_ + 0.2 * duration : duration;
     }
 
-    if (status != QProcess::NormalExit || exit_code != 0) {
-        emit output_text("[Compile] Failed");
-        emit compile_finished(false, QString(), "compile failed");
-        return;
+    // A result is shown only if nothing newer has been displayed.
+    if (message != "canceled" && generation > shown_generation_) {
+        shown_generation_ = generation;
+        if (!pinned_key.isEmpty()) {
+            handed_keys_[generation] = pinned_key;
+        }
+        emit compile_finished(generation, success, pdf_path, message, anchors);
+    } else if (!pinned_key.isEmpty()) {
+        compilecache::release(pinned_key);
     }
 
-    const QString pdf_path = work_dir_path_ + "/document.pdf";
-    emit output_text("[Preview] PDF updated (with injected grid)");
-    emit compile_finished(true, pdf_path, "ok");
+    dispatch_pending();
 }
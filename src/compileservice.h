@@ -1,42 +1,100 @@
 #ifndef COMPILESERVICE_H
 #define COMPILESERVICE_H
 
+#include <QElapsedTimer>
 #include <QObject>
-#include <QProcess>
 #include <QString>
 #include <QTemporaryDir>
-#include <memory>
+#include <QThread>
+#include <map>
+#include <vector>
 
+#include "model.h"
+
+class cacheprobe;
+class compileworker;
+
+// Schedules compiles over a small pool of workers, each on its own background thread. Requests are
+// numbered in order and checked against the compile cache off the GUI thread first; a result is
+// only reported when nothing newer has been reported before it.
 class compileservice : public QObject {
     Q_OBJECT
 
 public:
     explicit compileservice(QObject *parent = nullptr);
+    ~compileservice() override;
 
     bool is_busy() const;
     void cancel();
-    void compile(const QString &source_text, int grid_step_mm, int grid_extent_cm);
+    quint64 compile(const QString &source_text);
     void set_compiler_command(const QString &command);
     QString compiler_command() const;
+    // Draws the grid into later compiles; a step of 0 turns it off again.
+    void set_source_grid(int step_mm, int extent_cm);
+    double average_compile_ms() const;
+    // The result of generation is on screen; cache entries of older results may be evicted again.
+    void preview_shown(quint64 generation);
 
 signals:
     void output_text(const QString &text);
-    void compile_finished(bool success, const QString &pdf_path, const QString &message);
+    void phase_reached(quint64 generation, int phase, qint64 timestamp_us);
+    void compile_finished(quint64 generation,
+                          bool success,
+                          const QString &pdf_path,
+                          const QString &message,
+                          const page_anchors &anchors);
 
 private slots:
-    void on_ready_output();
-    void on_finished(int exit_code, QProcess::ExitStatus status);
+    void on_cache_hit(quint64 generation, const QString &pdf_path, const page_anchors &anchors, const QString &key);
+    void on_cache_miss(quint64 generation,
+                       const QString &document_text,
+                       const QString &compiler_command,
+                       const QString &key);
+    void on_worker_output(quint64 generation, const QString &text);
+    void on_job_finished(quint64 generation,
+                         bool success,
+                         const QString &pdf_path,
+                         const QString &message,
+                         const page_anchors &anchors,
+                         qint64 elapsed_ms,
+                         const QString &pinned_key);
 
 private:
-    bool ensure_work_dir();
-    static QString format_step(double step);
-    static QString inject_grid(const QString &source, int grid_step_mm, int grid_extent_cm);
-
-    QProcess proc_;
-    QString work_dir_path_;
-    std::unique_ptr<QTemporaryDir> temp_dir_;
-    bool canceled_ = false;
+    // GUI-side view of a worker; the worker itself is only reached through queued calls.
+    struct worker_slot {
+        compileworker *worker = nullptr;
+        QThread *thread = nullptr;
+        bool busy = false;
+        bool cancel_requested = false;
+        quint64 generation = 0;
+        QElapsedTimer started;
+    };
+
+    void dispatch_pending();
+    void cancel_job(const worker_slot &slot);
+    // Cancels the pending request and the running jobs that are older than generation.
+    void cancel_older(quint64 generation);
+
+    // Preamble formats built by one worker and copied by the others.
+    QTemporaryDir format_dir_;
+    std::vector<worker_slot> workers_;
+    QThread probe_thread_;
+    cacheprobe *probe_ = nullptr;
+    int probes_in_flight_ = 0;
+    quint64 next_generation_ = 0;
+    quint64 canceled_generation_ = 0;
+    quint64 shown_generation_ = 0;
+    // Pinned cache entries of the results reported to the preview, released once a newer one shows.
+    std::map<quint64, QString> handed_keys_;
+    QString pending_text_;
+    QString pending_command_;
+    QString pending_key_;
+    quint64 pending_generation_ = 0;
+    bool has_pending_ = false;
+    double average_compile_ms_ = 0.0;
     QString compiler_command_ = QStringLiteral("pdflatex");
+    int source_grid_step_mm_ = 0;
+    int source_grid_extent_cm_ = 0;
 };
 
 #endif
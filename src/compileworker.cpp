@@ -0,0 +1,526 @@
+#include "compileworker.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QProcessEnvironment>
+#include <QRegularExpression>
+#include <QTextStream>
+
+#include "compilecache.h"
+#include "latencytracker.h"
+#include "sourcefingerprint.h"
+
+namespace {
+
+// Number of output job names standby compilers rotate through, so a finished PDF is not
+// overwritten before the preview has read it.
+constexpr int standby_job_names = 4;
+
+// Preamble formats some worker is building, and those that failed to build, shared by all workers
+// so each preamble is dumped once.
+QMutex shared_formats_mutex;
+QSet<QString> building_formats;
+QSet<QString> failed_formats;
+
+// Claims the build of a format for the calling worker; false if another worker builds it or it
+// has failed before.
+bool claim_format_build(const QString &hash) {
+    const QMutexLocker locker(&shared_formats_mutex);
+    if (building_formats.contains(hash) || failed_formats.contains(hash)) {
+        return false;
+    }
+    building_formats.insert(hash);
+    return true;
+}
+
+void release_format_build(const QString &hash, bool failed) {
+    const QMutexLocker locker(&shared_formats_mutex);
+    building_formats.remove(hash);
+    if (failed) {
+        failed_formats.insert(hash);
+    }
+}
+
+} // namespace
+
+compileworker::compileworker(QObject *parent)
+    : QObject(parent), proc_(this), active_proc_(&proc_), active_jobname_("document"), format_proc_(this) {
+    connect(&proc_, &QProcess::started, this, &compileworker::on_started);
+    connect(&proc_, &QProcess::errorOccurred, this, &compileworker::on_error);
+    connect(&proc_, &QProcess::readyReadStandardOutput, this, &compileworker::on_ready_output);
+    connect(&proc_, &QProcess::readyReadStandardError, this, &compileworker::on_ready_output);
+    connect(&proc_, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), this, &compileworker::on_finished);
+    connect(&format_proc_,
+            qOverload<int, QProcess::ExitStatus>(&QProcess::finished),
+            this,
+            &compileworker::on_format_finished);
+    connect(&format_proc_, &QProcess::errorOccurred, this, [this](QProcess::ProcessError error) {
+        if (error == QProcess::FailedToStart) {
+            failed_format_hashes_.insert(format_building_hash_);
+            release_format_build(format_building_hash_, true);
+            format_building_hash_.clear();
+        }
+    });
+}
+
+void compileworker::set_format_dir(const QString &dir_path) {
+    format_dir_path_ = dir_path;
+}
+
+void compileworker::set_standby_limit(int limit) {
+    standby_limit_ = qMax(0, limit);
+}
+
+void compileworker::cancel(quint64 generation) {
+    if (!running_ || generation != generation_) {
+        return;
+    }
+    canceled_ = true;
+    active_proc_->kill();
+}
+
+bool compileworker::ensure_work_dir() {
+    if (!work_dir_path_.isEmpty()) {
+        return true;
+    }
+    temp_dir_ = std::make_unique<QTemporaryDir>();
+    if (!temp_dir_->isValid()) {
+        return false;
+    }
+    work_dir_path_ = temp_dir_->path();
+    return true;
+}
+
+void compileworker::fail(const QString &output, const QString &message) {
+    running_ = false;
+    emit output_text(generation_, output);
+    emit job_finished(generation_, false, QString(), message, page_anchors(), elapsed_.elapsed(), QString());
+}
+
+void compileworker::start(quint64 generation,
+                          const QString &document_text,
+                          const QString &compiler_command,
+                          const QString &cache_key) {
+    if (running_) {
+        return;
+    }
+    running_ = true;
+    canceled_ = false;
+    output_seen_ = false;
+    generation_ = generation;
+    cache_key_ = cache_key;
+    elapsed_.start();
+    if (compiler_command != compiler_command_) {
+        retire_standbys();
+        compiler_command_ = compiler_command;
+    }
+
+    if (!ensure_work_dir()) {
+        fail("[Compile] Could not create temporary directory", "workdir creation failed");
+        return;
+    }
+
+    QStringList command_parts = QProcess::splitCommand(compiler_command_);
+    QString program = QStringLiteral("pdflatex");
+    if (!command_parts.isEmpty()) {
+        program = command_parts.takeFirst();
+    }
+    // A commented-out or verbatim "\begin{document}" does not end the preamble.
+    static const QString begin_document = QStringLiteral("\\begin{document}");
+    const int body_pos = sourcefingerprint::find_code(document_text, begin_document);
+    const int body_start = body_pos + static_cast<int>(begin_document.size());
+    const int body_end =
+        body_pos < 0 ? -1 : sourcefingerprint::find_code(document_text, u"\\end{document}", body_start);
+    const bool split_body = body_pos >= 0 && body_end > body_pos;
+    const QString preamble = split_body ? document_text.left(body_pos) : QString();
+    const QString hash = split_body ? preamble_hash(compiler_command_, preamble) : QString();
+    QStringList args = command_parts;
+    if (split_body) {
+        const QString format_name = usable_format(preamble, program, command_parts);
+        if (!format_name.isEmpty()) {
+            args << "-fmt=" + format_name;
+        }
+    }
+    args << "-interaction=nonstopmode" << "-halt-on-error" << "-file-line-error";
+
+    emit output_text(generation_, "\n[Compile] " + QDateTime::currentDateTime().toString(Qt::ISODate));
+    if (split_body && take_standby(hash, document_text.mid(body_start, body_end - body_start) + "\n")) {
+        // The body's first line is the document line holding "\begin{document}".
+        standby_line_offset_ = static_cast<int>(document_text.left(body_start).count(QLatin1Char('\n')));
+        standby_partial_line_.clear();
+        emit phase_reached(generation_, static_cast<int>(latency_phase::tex_write), latencytracker::now_us());
+        // A standby is only handed a body once it runs, so its process was spawned before the compile.
+        emit phase_reached(generation_, static_cast<int>(latency_phase::process_spawn), latencytracker::now_us());
+        emit output_text(generation_, "[Compile] Running " + compiler_command_ + " (standby)...");
+        refill_standbys(hash, preamble, program, args);
+        return;
+    }
+
+    QFile tex_file(work_dir_path_ + "/document.tex");
+    if (!tex_file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        fail("[Compile] Could not write document.tex", "write failed");
+        return;
+    }
+
+    QTextStream out(&tex_file);
+    out << document_text;
+    tex_file.close();
+    emit phase_reached(generation_, static_cast<int>(latency_phase::tex_write), latencytracker::now_us());
+
+    emit output_text(generation_, "[Compile] Running " + compiler_command_ + "...");
+
+    active_proc_ = &proc_;
+    active_jobname_ = QStringLiteral("document");
+    proc_.setWorkingDirectory(work_dir_path_);
+    proc_.setProcessEnvironment(QProcessEnvironment::systemEnvironment());
+    // Standbys are only spawned once the compiler is known to start; see on_started().
+    refill_hash_ = split_body ? hash : QString();
+    refill_preamble_ = preamble;
+    refill_program_ = program;
+    refill_args_ = args;
+    proc_.start(program, QStringList(args) << "document.tex");
+}
+
+void compileworker::on_started() {
+    auto *process = qobject_cast<QProcess *>(sender());
+    if (running_ && process == active_proc_) {
+        emit phase_reached(generation_, static_cast<int>(latency_phase::process_spawn), latencytracker::now_us());
+    }
+    if (process != &proc_ || refill_hash_.isEmpty()) {
+        return;
+    }
+    const QString hash = refill_hash_;
+    refill_hash_.clear();
+    refill_standbys(hash, refill_preamble_, refill_program_, refill_args_);
+}
+
+void compileworker::on_error(QProcess::ProcessError error) {
+    if (error != QProcess::FailedToStart || !running_ || active_proc_ != &proc_) {
+        return;
+    }
+    refill_hash_.clear();
+    fail("[Error] Unable to start compiler: " + compiler_command_, "start failed");
+}
+
+QString compileworker::preamble_hash(const QString &compiler_command, const QString &preamble) {
+    const QByteArray input = (compiler_command + '\n' + preamble).toUtf8();
+    return QString::fromLatin1(QCryptographicHash::hash(input, QCryptographicHash::Sha256).toHex());
+}
+
+QString compileworker::format_base_for(const QString &program) {
+    // LuaTeX cannot dump a format with the packages' Lua state, so only pdfTeX and XeTeX qualify.
+    const QString name = QFileInfo(program).completeBaseName();
+    if (name == "pdflatex" || name == "xelatex" || name == "latex") {
+        return name;
+    }
+    return QString();
+}
+
+QString compileworker::usable_format(const QString &preamble, const QString &program, const QStringList &extra_args) {
+    if (format_base_for(program).isEmpty()) {
+        return QString();
+    }
+    const QString hash = preamble_hash(compiler_command_, preamble);
+    const QString format_name = "ktikz-" + hash;
+    const QString local_format = work_dir_path_ + "/" + format_name + ".fmt";
+    if (hash == format_ready_hash_ && QFileInfo::exists(local_format)) {
+        return format_name;
+    }
+    // Another worker may already have dumped this preamble; a copy is far cheaper than a build.
+    const QString shared_format = format_dir_path_ + "/" + format_name + ".fmt";
+    if (!format_dir_path_.isEmpty() && QFileInfo::exists(shared_format) &&
+        compilecache::place_file(shared_format, local_format, true)) {
+        format_ready_hash_ = hash;
+        return format_name;
+    }
+    if (format_proc_.state() == QProcess::NotRunning && !failed_format_hashes_.contains(hash) &&
+        claim_format_build(hash)) {
+        start_format_build(hash, preamble, program, extra_args);
+    }
+    return QString();
+}
+
+void compileworker::start_format_build(const QString &hash,
+                                        const QString &preamble,
+                                        const QString &program,
+                                        const QStringList &extra_args) {
+    // The preamble is dumped with mylatexformat; documents compiled against the format skip
+    // everything up to \begin{document}.
+    const QString format_name = "ktikz-" + hash;
+    QFile preamble_file(work_dir_path_ + "/" + format_name + ".tex");
+    if (!preamble_file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        failed_format_hashes_.insert(hash);
+        release_format_build(hash, false);
+        return;
+    }
+    QTextStream out(&preamble_file);
+    out << preamble << "\\begin{document}\n\\end{document}\n";
+    preamble_file.close();
+
+    QStringList args = extra_args;
+    args << "-ini" << "-interaction=batchmode" << "-halt-on-error" << "-jobname=" + format_name
+         << "&" + format_base_for(program) << "mylatexformat.ltx" << format_name + ".tex";
+    format_building_hash_ = hash;
+    format_proc_.setWorkingDirectory(work_dir_path_);
+    format_proc_.setProcessEnvironment(QProcessEnvironment::systemEnvironment());
+    format_proc_.start(program, args);
+}
+
+void compileworker::on_format_finished(int exit_code, QProcess::ExitStatus status) {
+    const QString hash = format_building_hash_;
+    format_building_hash_.clear();
+    const QString local_format = work_dir_path_ + "/ktikz-" + hash + ".fmt";
+    if (status == QProcess::NormalExit && exit_code == 0 && QFileInfo::exists(local_format)) {
+        format_ready_hash_ = hash;
+        if (!format_dir_path_.isEmpty()) {
+            compilecache::place_file(local_format, format_dir_path_ + "/ktikz-" + hash + ".fmt", false);
+        }
+        release_format_build(hash, false);
+        emit output_text(generation_, "[Compile] Preamble format ready");
+    } else {
+        failed_format_hashes_.insert(hash);
+        release_format_build(hash, status == QProcess::NormalExit);
+    }
+}
+
+bool compileworker::take_standby(const QString &hash, const QString &body) {
+    for (auto it = standbys_.begin(); it != standbys_.end(); ++it) {
+        if (it->preamble_hash != hash || it->process->state() != QProcess::Running) {
+            continue;
+        }
+        active_proc_ = it->process;
+        active_jobname_ = it->jobname;
+        standbys_.erase(it);
+        active_proc_->write(body.toUtf8());
+        active_proc_->closeWriteChannel();
+        return true;
+    }
+    return false;
+}
+
+void compileworker::refill_standbys(const QString &hash,
+                                     const QString &preamble,
+                                     const QString &program,
+                                     const QStringList &args) {
+#ifdef Q_OS_UNIX
+    // Standbys that failed to start or belong to another preamble would never be used again.
+    for (auto it = standbys_.begin(); it != standbys_.end();) {
+        if (it->process->state() == QProcess::NotRunning) {
+            it->process->deleteLater();
+            it = standbys_.erase(it);
+        } else if (it->preamble_hash != hash) {
+            it->process->kill();
+            it = standbys_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (standby_limit_ == 0 || failed_standby_hashes_.contains(hash)) {
+        return;
+    }
+
+    // The body is read from stdin once the engine reaches it, so the preamble is processed
+    // while the process is idle. The file is named by hash because waiting engines still read it.
+    const QString standby_file = "standby-" + hash + ".tex";
+    if (!QFileInfo::exists(work_dir_path_ + "/" + standby_file)) {
+        QFile file(work_dir_path_ + "/" + standby_file);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+            return;
+        }
+        QTextStream out(&file);
+        out << preamble << "\\begin{document}\n\\csname @@input\\endcsname /dev/stdin \n\\end{document}\n";
+    }
+
+    while (static_cast<int>(standbys_.size()) < standby_limit_) {
+        standby_process standby;
+        standby.preamble_hash = hash;
+        standby.jobname = "standby-" + QString::number(next_standby_job_);
+        next_standby_job_ = (next_standby_job_ + 1) % standby_job_names;
+        standby.process = new QProcess(this);
+        connect(standby.process, &QProcess::started, this, &compileworker::on_started);
+        connect(standby.process, &QProcess::readyReadStandardOutput, this, &compileworker::on_ready_output);
+        connect(standby.process, &QProcess::readyReadStandardError, this, &compileworker::on_ready_output);
+        connect(standby.process,
+                qOverload<int, QProcess::ExitStatus>(&QProcess::finished),
+                this,
+                &compileworker::on_finished);
+        standby.process->setWorkingDirectory(work_dir_path_);
+        standby.process->setProcessEnvironment(QProcessEnvironment::systemEnvironment());
+        standby.process->start(program, QStringList(args) << "-jobname=" + standby.jobname << standby_file);
+        standbys_.push_back(standby);
+    }
+#else
+    Q_UNUSED(hash)
+    Q_UNUSED(preamble)
+    Q_UNUSED(program)
+    Q_UNUSED(args)
+#endif
+}
+
+void compileworker::retire_standbys() {
+    for (const standby_process &standby : standbys_) {
+        if (standby.process->state() == QProcess::NotRunning) {
+            standby.process->deleteLater();
+        } else {
+            standby.process->kill();
+        }
+    }
+    standbys_.clear();
+}
+
+page_anchors compileworker::read_page_anchors(const QString &log_path) {
+    page_anchors anchors;
+    QFile log_file(log_path);
+    if (!log_file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return anchors;
+    }
+    const QString log_text = QString::fromLocal8Bit(log_file.readAll());
+
+    // Positions are reported in scaled points; convert them to PDF points.
+    constexpr double sp_to_bp = 72.0 / (72.27 * 65536.0);
+    static const QRegularExpression anchor_pattern(R"(ktikz-anchor ([oxy]) (-?\d+) (-?\d+))");
+    bool have_origin = false;
+    bool have_unit_x = false;
+    bool have_unit_y = false;
+    QRegularExpressionMatchIterator it = anchor_pattern.globalMatch(log_text);
+    while (it.hasNext()) {
+        const QRegularExpressionMatch m = it.next();
+        const double x = m.captured(2).toDouble() * sp_to_bp;
+        const double y = m.captured(3).toDouble() * sp_to_bp;
+        const QString which = m.captured(1);
+        if (which == "o") {
+            anchors.origin_x = x;
+            anchors.origin_y = y;
+            have_origin = true;
+        } else if (which == "x") {
+            anchors.unit_x_x = x;
+            anchors.unit_x_y = y;
+            have_unit_x = true;
+        } else {
+            anchors.unit_y_x = x;
+            anchors.unit_y_y = y;
+            have_unit_y = true;
+        }
+    }
+    anchors.valid = have_origin && have_unit_x && have_unit_y;
+    return anchors;
+}
+
+void compileworker::on_ready_output() {
+    auto *process = qobject_cast<QProcess *>(sender());
+    if (process == nullptr) {
+        return;
+    }
+    const QByteArray std_out = process->readAllStandardOutput();
+    const QByteArray std_err = process->readAllStandardError();
+    // Standbys report the preamble while idle; that output belongs to no compile.
+    if (process != active_proc_ || !running_) {
+        return;
+    }
+    if (!output_seen_ && (!std_out.isEmpty() || !std_err.isEmpty())) {
+        output_seen_ = true;
+        emit phase_reached(generation_, static_cast<int>(latency_phase::first_output), latencytracker::now_us());
+    }
+    if (process != &proc_) {
+        // Locations are rewritten line by line, so a line split across reads waits for its end.
+        const QString text = standby_partial_line_ + QString::fromLocal8Bit(std_out);
+        const int complete = static_cast<int>(text.lastIndexOf(QLatin1Char('\n'))) + 1;
+        standby_partial_line_ = text.mid(complete);
+        if (complete > 0) {
+            emit output_text(generation_, map_standby_lines(text.left(complete)));
+        }
+        if (!std_err.isEmpty()) {
+            emit output_text(generation_, map_standby_lines(QString::fromLocal8Bit(std_err)));
+        }
+        return;
+    }
+    if (!std_out.isEmpty()) {
+        emit output_text(generation_, QString::fromLocal8Bit(std_out));
+    }
+    if (!std_err.isEmpty()) {
+        emit output_text(generation_, QString::fromLocal8Bit(std_err));
+    }
+}
+
+QString compileworker::map_standby_lines(const QString &text) const {
+    // Standbys read the body from /dev/stdin, so TeX counts its lines from the body's start. The
+    // standby file itself starts with the document's preamble, whose lines need no offset.
+    static const QRegularExpression location_pattern(R"((/dev/stdin|\./standby-[0-9a-f]+\.tex):(\d+):)");
+    QString out;
+    int copied = 0;
+    QRegularExpressionMatchIterator it = location_pattern.globalMatch(text);
+    while (it.hasNext()) {
+        const QRegularExpressionMatch m = it.next();
+        const int offset = m.captured(1) == QLatin1String("/dev/stdin") ? standby_line_offset_ : 0;
+        out += QStringView(text).mid(copied, m.capturedStart() - copied);
+        out += "./document.tex:" + QString::number(m.captured(2).toInt() + offset) + ":";
+        copied = static_cast<int>(m.capturedEnd());
+    }
+    out += QStringView(text).mid(copied);
+    return out;
+}
+
+void compileworker::on_finished(int exit_code, QProcess::ExitStatus status) {
+    auto *process = qobject_cast<QProcess *>(sender());
+    if (process != active_proc_ || !running_) {
+        // A standby exited before receiving a body, usually because its preamble failed.
+        for (auto it = standbys_.begin(); it != standbys_.end(); ++it) {
+            if (it->process == process) {
+                if (status == QProcess::NormalExit) {
+                    failed_standby_hashes_.insert(it->preamble_hash);
+                }
+                standbys_.erase(it);
+                break;
+            }
+        }
+        if (process != nullptr && process != &proc_) {
+            process->deleteLater();
+        }
+        return;
+    }
+
+    emit phase_reached(generation_, static_cast<int>(latency_phase::process_exit), latencytracker::now_us());
+    const QString jobname = active_jobname_;
+    if (active_proc_ != &proc_) {
+        if (!standby_partial_line_.isEmpty()) {
+            emit output_text(generation_, map_standby_lines(standby_partial_line_));
+            standby_partial_line_.clear();
+        }
+        active_proc_->deleteLater();
+        active_proc_ = &proc_;
+        active_jobname_ = QStringLiteral("document");
+    }
+    running_ = false;
+
+    if (canceled_) {
+        canceled_ = false;
+        emit output_text(generation_, "[Compile] Canceled");
+        emit job_finished(generation_, false, QString(), "canceled", page_anchors(), elapsed_.elapsed(), QString());
+        return;
+    }
+
+    if (status != QProcess::NormalExit || exit_code != 0) {
+        emit output_text(generation_, "[Compile] Failed");
+        emit job_finished(
+            generation_, false, QString(), "compile failed", page_anchors(), elapsed_.elapsed(), QString());
+        return;
+    }
+
+    // The cached copy is reported when available: later jobs in this work dir cannot overwrite it.
+    const QString pdf_path = work_dir_path_ + "/" + jobname + ".pdf";
+    const QString log_path = work_dir_path_ + "/" + jobname + ".log";
+    QString shown_pdf = pdf_path;
+    const bool cached = compilecache::store(cache_key_, pdf_path, log_path, shown_pdf);
+    emit output_text(generation_, "[Preview] PDF updated");
+    emit job_finished(generation_,
+                      true,
+                      shown_pdf,
+                      "ok",
+                      read_page_anchors(log_path),
+                      elapsed_.elapsed(),
+                      cached ? cache_key_ : QString());
+}
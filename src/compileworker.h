@@ -0,0 +1,118 @@
+#ifndef COMPILEWORKER_H
+#define COMPILEWORKER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QProcess>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <memory>
+#include <vector>
+
+#include "model.h"
+
+// Runs one compile at a time in a private work directory, so several workers can compile
+// concurrently. A worker may keep a standby compiler; a preamble format is built by one worker
+// and copied by the others. Workers live on background threads: process startup, output
+// collection and caching never touch the GUI thread.
+class compileworker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit compileworker(QObject *parent = nullptr);
+
+    static page_anchors read_page_anchors(const QString &log_path);
+    // Directory where finished preamble formats are shared with the other workers. Set before
+    // the first compile.
+    void set_format_dir(const QString &dir_path);
+    // Idle standby compilers this worker keeps; 0 compiles every request cold. Set before the
+    // first compile.
+    void set_standby_limit(int limit);
+
+public slots:
+    void start(quint64 generation,
+               const QString &document_text,
+               const QString &compiler_command,
+               const QString &cache_key);
+    void cancel(quint64 generation);
+
+signals:
+    void output_text(quint64 generation, const QString &text);
+    void phase_reached(quint64 generation, int phase, qint64 timestamp_us);
+    // pinned_key names the cache entry holding pdf_path, pinned for the receiver to release; it
+    // is empty when the PDF is not in the cache.
+    void job_finished(quint64 generation,
+                      bool success,
+                      const QString &pdf_path,
+                      const QString &message,
+                      const page_anchors &anchors,
+                      qint64 elapsed_ms,
+                      const QString &pinned_key);
+
+private slots:
+    void on_ready_output();
+    void on_started();
+    void on_error(QProcess::ProcessError error);
+    void on_finished(int exit_code, QProcess::ExitStatus status);
+    void on_format_finished(int exit_code, QProcess::ExitStatus status);
+
+private:
+    bool ensure_work_dir();
+    void fail(const QString &output, const QString &message);
+    static QString preamble_hash(const QString &compiler_command, const QString &preamble);
+    static QString format_base_for(const QString &program);
+    QString usable_format(const QString &preamble, const QString &program, const QStringList &extra_args);
+    void start_format_build(const QString &hash,
+                            const QString &preamble,
+                            const QString &program,
+                            const QStringList &extra_args);
+    bool take_standby(const QString &hash, const QString &body);
+    void refill_standbys(const QString &hash,
+                         const QString &preamble,
+                         const QString &program,
+                         const QStringList &args);
+    void retire_standbys();
+    // Output of a standby compile with its /dev/stdin line numbers turned into document lines.
+    QString map_standby_lines(const QString &text) const;
+
+    // A compiler process that has already processed the preamble and is blocked reading the
+    // document body from stdin.
+    struct standby_process {
+        QProcess *process = nullptr;
+        QString preamble_hash;
+        QString jobname;
+    };
+
+    QProcess proc_;
+    QProcess *active_proc_ = nullptr;
+    QString active_jobname_;
+    quint64 generation_ = 0;
+    bool running_ = false;
+    bool canceled_ = false;
+    bool output_seen_ = false;
+    QElapsedTimer elapsed_;
+    QString compiler_command_;
+    QString cache_key_;
+    QString refill_hash_;
+    QString refill_preamble_;
+    QString refill_program_;
+    QStringList refill_args_;
+    std::vector<standby_process> standbys_;
+    QSet<QString> failed_standby_hashes_;
+    int standby_limit_ = 1;
+    int next_standby_job_ = 0;
+    // Document lines before the body of the running standby compile, and its unfinished output line.
+    int standby_line_offset_ = 0;
+    QString standby_partial_line_;
+    QProcess format_proc_;
+    QString format_building_hash_;
+    QString format_ready_hash_;
+    QSet<QString> failed_format_hashes_;
+    QString format_dir_path_;
+    QString work_dir_path_;
+    std::unique_ptr<QTemporaryDir> temp_dir_;
+};
+
+#endif
@@ -1,304 +1,774 @@
 #include "coordinateparser.h"
 
-#include <QRegularExpression>
+#include <algorithm>
+#include <charconv>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <system_error>
+#include <utility>
 
 namespace {
 
-const QRegularExpression &coord_pattern() {
-    static const QRegularExpression pattern(
-        R"(\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\))");
-    return pattern;
+// A number as TikZ coordinates are written here: [+-]?(\d+(\.\d+)?|\.\d+)([eE][+-]?\d+)?
+struct number_token {
+    int start = 0;
+    int end = 0;
+    double value = 0.0;
+    bool ok = false;
+};
+
+// "(x,y)" with optional blanks around both numbers.
+struct pair_token {
+    int start = 0;
+    int end = 0;
+    number_token x;
+    number_token y;
+};
+
+bool is_space(QChar c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
 }
 
-const QRegularExpression &circle_pattern() {
-    static const QRegularExpression pattern(
-        R"(\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*circle\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\))");
-    return pattern;
+bool is_digit(QChar c) {
+    return c >= '0' && c <= '9';
 }
 
-const QRegularExpression &ellipse_pattern() {
-    static const QRegularExpression pattern(
-        R"(\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*ellipse\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*and\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\))");
-    return pattern;
+int skip_spaces(QStringView s, int pos) {
+    while (pos < s.size() && is_space(s.at(pos))) {
+        ++pos;
+    }
+    return pos;
 }
 
-const QRegularExpression &bezier_pattern() {
-    static const QRegularExpression pattern(
-        R"((?:\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*)?\.\.\s*controls\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*and\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*\.\.\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\))");
-    return pattern;
+bool at_char(QStringView s, int pos, char c) {
+    return pos < s.size() && s.at(pos) == QLatin1Char(c);
 }
 
-const QRegularExpression &rectangle_pattern() {
-    static const QRegularExpression pattern(
-        R"(\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\)\s*rectangle\s*\(\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*,\s*([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?)\s*\))");
-    return pattern;
+// Position after `word` if the source continues with it at pos, otherwise -1.
+int match_word(QStringView s, int pos, QLatin1String word) {
+    return s.mid(pos).startsWith(word) ? pos + static_cast<int>(word.size()) : -1;
 }
 
-} // namespace
+// Digits at pos accumulated into mantissa; returns the position after them.
+int scan_digits(QStringView s, int pos, quint64 &mantissa, int &digits) {
+    while (pos < s.size() && is_digit(s.at(pos))) {
+        if (mantissa < 1000000000000000000ULL) {
+            mantissa = mantissa * 10 + static_cast<quint64>(s.at(pos).unicode() - '0');
+            ++digits;
+        } else {
+            // Too many significant digits for the exact path below.
+            digits = 100;
+        }
+        ++pos;
+    }
+    return pos;
+}
 
-namespace coordinateparser {
+// Full conversion for the numbers the exact path in match_number() cannot take.
+bool convert_number(QStringView text, double &value) {
+#if defined(__cpp_lib_to_chars)
+    // Numbers are ASCII, so short ones are narrowed on the stack instead of through a QByteArray.
+    char buffer[64];
+    if (text.size() < static_cast<qsizetype>(sizeof(buffer))) {
+        int n = 0;
+        for (int i = text.startsWith(QLatin1Char('+')) ? 1 : 0; i < text.size(); ++i) {
+            buffer[n++] = static_cast<char>(text.at(i).unicode());
+        }
+        const auto [end, error] = std::from_chars(buffer, buffer + n, value);
+        return error == std::errc() && end == buffer + n;
+    }
+#endif
+    bool ok = false;
+    value = text.toDouble(&ok);
+    return ok;
+}
 
-std::vector<coord_ref> extract_refs(const QString &source) {
-    std::vector<coord_ref> refs;
-    QRegularExpressionMatchIterator it = coord_pattern().globalMatch(source);
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        bool ok_x = false;
-        bool ok_y = false;
-        const double x = m.captured(1).toDouble(&ok_x);
-        const double y = m.captured(2).toDouble(&ok_y);
-        if (!ok_x || !ok_y) {
-            continue;
+// Longest number at pos. Every pattern continues after a number with a blank, ',', ')' or "and",
+// none of which can extend a number, so the longest match is the only one that can succeed.
+bool match_number(QStringView s, int pos, number_token &out) {
+    static constexpr double powers_of_ten[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                               1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                               1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    int i = pos;
+    const bool negative = at_char(s, i, '-');
+    if (negative || at_char(s, i, '+')) {
+        ++i;
+    }
+    quint64 mantissa = 0;
+    int digits = 0;
+    int fraction_digits = 0;
+    const int int_end = scan_digits(s, i, mantissa, digits);
+    if (int_end > i) {
+        i = int_end;
+        if (at_char(s, i, '.') && i + 1 < s.size() && is_digit(s.at(i + 1))) {
+            const int before = digits;
+            i = scan_digits(s, i + 1, mantissa, digits);
+            fraction_digits = digits - before;
+        }
+    } else if (at_char(s, i, '.') && i + 1 < s.size() && is_digit(s.at(i + 1))) {
+        i = scan_digits(s, i + 1, mantissa, digits);
+        fraction_digits = digits;
+    } else {
+        return false;
+    }
+    int exponent = 0;
+    if (at_char(s, i, 'e') || at_char(s, i, 'E')) {
+        int k = i + 1;
+        const bool negative_exponent = at_char(s, k, '-');
+        if (negative_exponent || at_char(s, k, '+')) {
+            ++k;
+        }
+        if (k < s.size() && is_digit(s.at(k))) {
+            while (k < s.size() && is_digit(s.at(k))) {
+                exponent = qMin(exponent * 10 + (s.at(k).unicode() - '0'), 100000);
+                ++k;
+            }
+            exponent = negative_exponent ? -exponent : exponent;
+            i = k;
         }
+    }
+    out.start = pos;
+    out.end = i;
 
-        coord_ref ref;
-        ref.start = m.capturedStart(0);
-        ref.end = ref.start + m.capturedLength(0);
-        ref.x_start = m.capturedStart(1);
-        ref.x_end = ref.x_start + m.capturedLength(1);
-        ref.y_start = m.capturedStart(2);
-        ref.y_end = ref.y_start + m.capturedLength(2);
-        ref.x = x;
-        ref.y = y;
-        refs.push_back(ref);
-    }
-    return refs;
-}
-
-std::vector<coord_pair> extract_pairs(const QString &source) {
-    std::vector<coord_pair> pairs;
-    const std::vector<coord_ref> refs = extract_refs(source);
-    pairs.reserve(refs.size());
-    for (const coord_ref &ref : refs) {
-        pairs.push_back({ref.x, ref.y});
-    }
-    return pairs;
-}
-
-std::vector<circle_ref> extract_circle_refs(const QString &source) {
-    std::vector<circle_ref> refs;
-    QRegularExpressionMatchIterator it = circle_pattern().globalMatch(source);
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        bool ok_cx = false;
-        bool ok_cy = false;
-        bool ok_r = false;
-        const double cx = m.captured(1).toDouble(&ok_cx);
-        const double cy = m.captured(2).toDouble(&ok_cy);
-        const double r = m.captured(3).toDouble(&ok_r);
-        if (!ok_cx || !ok_cy || !ok_r) {
-            continue;
+    // A mantissa below 2^53 scaled by an exact power of ten rounds correctly in one operation;
+    // anything else goes through the full conversion.
+    const int scale = exponent - fraction_digits;
+    if (digits <= 18 && mantissa <= (1ULL << 53) && scale >= -22 && scale <= 22) {
+        const double m = static_cast<double>(mantissa);
+        const double value = scale < 0 ? m / powers_of_ten[-scale] : m * powers_of_ten[scale];
+        out.value = negative ? -value : value;
+        out.ok = true;
+    } else {
+        out.ok = convert_number(s.mid(pos, i - pos), out.value);
+    }
+    return true;
+}
+
+// Number surrounded by optional blanks; returns the position after the trailing blanks or -1.
+int match_spaced_number(QStringView s, int pos, number_token &out) {
+    if (!match_number(s, skip_spaces(s, pos), out)) {
+        return -1;
+    }
+    return skip_spaces(s, out.end);
+}
+
+bool match_pair(QStringView s, int pos, pair_token &out) {
+    if (!at_char(s, pos, '(')) {
+        return false;
+    }
+    int i = match_spaced_number(s, pos + 1, out.x);
+    if (i < 0 || !at_char(s, i, ',')) {
+        return false;
+    }
+    i = match_spaced_number(s, i + 1, out.y);
+    if (i < 0 || !at_char(s, i, ')')) {
+        return false;
+    }
+    out.start = pos;
+    out.end = i + 1;
+    return true;
+}
+
+// "keyword (" after optional blanks; returns the position after the parenthesis or -1.
+int match_keyword_paren(QStringView s, int pos, QLatin1String keyword) {
+    const int i = match_word(s, skip_spaces(s, pos), keyword);
+    if (i < 0) {
+        return -1;
+    }
+    const int paren = skip_spaces(s, i);
+    return at_char(s, paren, '(') ? paren + 1 : -1;
+}
+
+// "circle (r)" following a pair ending at pos; returns the end of the match or -1.
+int match_circle_tail(QStringView s, int pos, number_token &r) {
+    int i = match_keyword_paren(s, pos, QLatin1String("circle"));
+    if (i < 0) {
+        return -1;
+    }
+    i = match_spaced_number(s, i, r);
+    return i >= 0 && at_char(s, i, ')') ? i + 1 : -1;
+}
+
+// "ellipse (rx and ry)" following a pair ending at pos.
+int match_ellipse_tail(QStringView s, int pos, number_token &rx, number_token &ry) {
+    int i = match_keyword_paren(s, pos, QLatin1String("ellipse"));
+    if (i < 0) {
+        return -1;
+    }
+    i = match_spaced_number(s, i, rx);
+    if (i < 0 || (i = match_word(s, i, QLatin1String("and"))) < 0) {
+        return -1;
+    }
+    i = match_spaced_number(s, i, ry);
+    return i >= 0 && at_char(s, i, ')') ? i + 1 : -1;
+}
+
+// "rectangle (x,y)" following a pair ending at pos.
+int match_rectangle_tail(QStringView s, int pos, pair_token &corner) {
+    const int i = match_word(s, skip_spaces(s, pos), QLatin1String("rectangle"));
+    if (i < 0 || !match_pair(s, skip_spaces(s, i), corner)) {
+        return -1;
+    }
+    return corner.end;
+}
+
+// ".. controls (x1,y1) and (x2,y2) .. (x3,y3)" starting at pos.
+int match_bezier_tail(QStringView s, int pos, pair_token &c1, pair_token &c2, pair_token &end) {
+    int i = match_word(s, pos, QLatin1String(".."));
+    if (i < 0 || (i = match_word(s, skip_spaces(s, i), QLatin1String("controls"))) < 0) {
+        return -1;
+    }
+    if (!match_pair(s, skip_spaces(s, i), c1)) {
+        return -1;
+    }
+    i = match_word(s, skip_spaces(s, c1.end), QLatin1String("and"));
+    if (i < 0 || !match_pair(s, skip_spaces(s, i), c2)) {
+        return -1;
+    }
+    i = match_word(s, skip_spaces(s, c2.end), QLatin1String(".."));
+    if (i < 0 || !match_pair(s, skip_spaces(s, i), end)) {
+        return -1;
+    }
+    return end.end;
+}
+
+void append_row(primitive_table &table, primitive_kind kind, int start, int end,
+                std::initializer_list<number_token> numbers) {
+    table.kind.push_back(kind);
+    table.id.push_back(0);
+    table.start.push_back(start);
+    table.end.push_back(end);
+    int slot = 0;
+    for (const number_token &number : numbers) {
+        table.span_start[slot].push_back(number.start);
+        table.span_end[slot].push_back(number.end);
+        table.value[slot].push_back(number.value);
+        ++slot;
+    }
+    for (; slot < primitive_table::slot_count; ++slot) {
+        table.span_start[slot].push_back(-1);
+        table.span_end[slot].push_back(-1);
+        table.value[slot].push_back(0.0);
+    }
+}
+
+// Moves the source offsets of rows [first, last) by delta; spans a row does not have stay -1.
+void shift_rows(primitive_table &table, int first, int last, int delta) {
+    if (delta == 0) {
+        return;
+    }
+    for (int row = first; row < last; ++row) {
+        table.start[row] += delta;
+        table.end[row] += delta;
+    }
+    for (int slot = 0; slot < primitive_table::slot_count; ++slot) {
+        std::vector<int> &starts = table.span_start[slot];
+        std::vector<int> &ends = table.span_end[slot];
+        for (int row = first; row < last; ++row) {
+            if (starts[row] >= 0) {
+                starts[row] += delta;
+                ends[row] += delta;
+            }
+        }
+    }
+}
+
+// Rows whose start lies in [start, end); rows are ordered by start.
+coordinateparser::index_range rows_within(const primitive_table &table, int start, int end) {
+    const auto first = std::lower_bound(table.start.begin(), table.start.end(), start);
+    const auto last = std::lower_bound(first, table.start.end(), end);
+    return {static_cast<int>(first - table.start.begin()), static_cast<int>(last - table.start.begin())};
+}
+
+bool same_values(const primitive_table &a, int a_row, const primitive_table &b, int b_row) {
+    for (int slot = 0; slot < primitive_table::slot_count; ++slot) {
+        if (a.value[slot][a_row] != b.value[slot][b_row]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same primitive with its offsets in b moved by delta.
+bool same_row(const primitive_table &a, int a_row, const primitive_table &b, int b_row, int delta) {
+    if (a.kind[a_row] != b.kind[b_row] || a.start[a_row] + delta != b.start[b_row] ||
+        a.end[a_row] + delta != b.end[b_row] || !same_values(a, a_row, b, b_row)) {
+        return false;
+    }
+    for (int slot = 0; slot < primitive_table::slot_count; ++slot) {
+        const int span = a.span_start[slot][a_row];
+        if (b.span_start[slot][b_row] != (span < 0 ? span : span + delta) ||
+            b.span_end[slot][b_row] - b.span_start[slot][b_row] != a.span_end[slot][a_row] - span) {
+            return false;
         }
+    }
+    return true;
+}
 
-        circle_ref ref;
-        ref.cx_start = m.capturedStart(1);
-        ref.cx_end = ref.cx_start + m.capturedLength(1);
-        ref.cy_start = m.capturedStart(2);
-        ref.cy_end = ref.cy_start + m.capturedLength(2);
-        ref.radius_start = m.capturedStart(3);
-        ref.radius_end = ref.radius_start + m.capturedLength(3);
-        ref.cx = cx;
-        ref.cy = cy;
-        ref.r = r;
-        refs.push_back(ref);
-    }
-    return refs;
-}
-
-std::vector<circle_pair> extract_circle_pairs(const QString &source) {
-    std::vector<circle_pair> pairs;
-    const std::vector<circle_ref> refs = extract_circle_refs(source);
-    pairs.reserve(refs.size());
-    for (const circle_ref &ref : refs) {
-        pairs.push_back({ref.cx, ref.cy, ref.r});
-    }
-    return pairs;
-}
-
-std::vector<ellipse_ref> extract_ellipse_refs(const QString &source) {
-    std::vector<ellipse_ref> refs;
-    QRegularExpressionMatchIterator it = ellipse_pattern().globalMatch(source);
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        bool ok_cx = false;
-        bool ok_cy = false;
-        bool ok_rx = false;
-        bool ok_ry = false;
-        const double cx = m.captured(1).toDouble(&ok_cx);
-        const double cy = m.captured(2).toDouble(&ok_cy);
-        const double rx = m.captured(3).toDouble(&ok_rx);
-        const double ry = m.captured(4).toDouble(&ok_ry);
-        if (!ok_cx || !ok_cy || !ok_rx || !ok_ry) {
+// Gives the fresh rows [fresh_first, fresh_last) the ids of the rows [first, last) they replace.
+// Within each kind, rows pair up in order when their counts agree, as after editing numbers;
+// otherwise equal values pair up, first from both ends and then anywhere in between. Fresh rows
+// left over get new ids.
+void match_ids(const primitive_table &table, int first, int last, primitive_table &fresh, int fresh_first,
+               int fresh_last, quint32 &next_id) {
+    std::fill(fresh.id.begin() + fresh_first, fresh.id.begin() + fresh_last, 0);
+    std::vector<int> old_rows;
+    std::vector<int> new_rows;
+    for (int k = 0; k <= static_cast<int>(primitive_kind::rectangle); ++k) {
+        const auto kind = static_cast<primitive_kind>(k);
+        old_rows.clear();
+        new_rows.clear();
+        for (int row = first; row < last; ++row) {
+            if (table.kind[row] == kind) {
+                old_rows.push_back(row);
+            }
+        }
+        for (int row = fresh_first; row < fresh_last; ++row) {
+            if (fresh.kind[row] == kind) {
+                new_rows.push_back(row);
+            }
+        }
+        const int old_count = static_cast<int>(old_rows.size());
+        const int new_count = static_cast<int>(new_rows.size());
+        const auto pair = [&](int old_index, int new_index) {
+            fresh.id[new_rows[new_index]] = table.id[old_rows[old_index]];
+        };
+        if (old_count == new_count) {
+            for (int i = 0; i < new_count; ++i) {
+                pair(i, i);
+            }
             continue;
         }
+        const int common = qMin(old_count, new_count);
+        int head = 0;
+        while (head < common && same_values(table, old_rows[head], fresh, new_rows[head])) {
+            pair(head, head);
+            ++head;
+        }
+        int tail = 0;
+        while (tail < common - head &&
+               same_values(table, old_rows[old_count - 1 - tail], fresh, new_rows[new_count - 1 - tail])) {
+            pair(old_count - 1 - tail, new_count - 1 - tail);
+            ++tail;
+        }
+        std::vector<bool> taken(static_cast<std::size_t>(old_count - tail - head), false);
+        for (int j = head; j < new_count - tail; ++j) {
+            for (int i = head; i < old_count - tail; ++i) {
+                if (!taken[i - head] && same_values(table, old_rows[i], fresh, new_rows[j])) {
+                    taken[i - head] = true;
+                    pair(i, j);
+                    break;
+                }
+            }
+        }
+    }
+    for (int row = fresh_first; row < fresh_last; ++row) {
+        if (fresh.id[row] == 0) {
+            fresh.id[row] = next_id++;
+        }
+    }
+}
 
-        ellipse_ref ref;
-        ref.cx_start = m.capturedStart(1);
-        ref.cx_end = ref.cx_start + m.capturedLength(1);
-        ref.cy_start = m.capturedStart(2);
-        ref.cy_end = ref.cy_start + m.capturedLength(2);
-        ref.rx_start = m.capturedStart(3);
-        ref.rx_end = ref.rx_start + m.capturedLength(3);
-        ref.ry_start = m.capturedStart(4);
-        ref.ry_end = ref.ry_start + m.capturedLength(4);
-        ref.cx = cx;
-        ref.cy = cy;
-        ref.rx = rx;
-        ref.ry = ry;
-        refs.push_back(ref);
+// Overwrites column[first, last) with fresh[fresh_first, fresh_last), inserting or erasing only
+// the difference in length.
+template <typename T>
+void replace_column(std::vector<T> &column, int first, int last, const std::vector<T> &fresh, int fresh_first,
+                    int fresh_last) {
+    const int common = qMin(last - first, fresh_last - fresh_first);
+    std::copy_n(fresh.begin() + fresh_first, common, column.begin() + first);
+    if (fresh_last - fresh_first > common) {
+        column.insert(column.begin() + last, fresh.begin() + fresh_first + common, fresh.begin() + fresh_last);
+    } else {
+        column.erase(column.begin() + first + common, column.begin() + last);
     }
-    return refs;
 }
 
-std::vector<ellipse_pair> extract_ellipse_pairs(const QString &source) {
-    std::vector<ellipse_pair> pairs;
-    const std::vector<ellipse_ref> refs = extract_ellipse_refs(source);
-    pairs.reserve(refs.size());
-    for (const ellipse_ref &ref : refs) {
-        pairs.push_back({ref.cx, ref.cy, ref.rx, ref.ry});
+void replace_rows(primitive_table &table, int first, int last, const primitive_table &fresh, int fresh_first,
+                  int fresh_last) {
+    replace_column(table.kind, first, last, fresh.kind, fresh_first, fresh_last);
+    replace_column(table.id, first, last, fresh.id, fresh_first, fresh_last);
+    replace_column(table.start, first, last, fresh.start, fresh_first, fresh_last);
+    replace_column(table.end, first, last, fresh.end, fresh_first, fresh_last);
+    for (int slot = 0; slot < primitive_table::slot_count; ++slot) {
+        replace_column(table.span_start[slot], first, last, fresh.span_start[slot], fresh_first, fresh_last);
+        replace_column(table.span_end[slot], first, last, fresh.span_end[slot], fresh_first, fresh_last);
+        replace_column(table.value[slot], first, last, fresh.value[slot], fresh_first, fresh_last);
     }
-    return pairs;
 }
 
-std::vector<bezier_ref> extract_bezier_refs(const QString &source) {
-    std::vector<bezier_ref> refs;
-    QRegularExpressionMatchIterator it = bezier_pattern().globalMatch(source);
+void shift(coordinateparser::statement_ref &statement, int delta) {
+    statement.start += delta;
+    statement.end += delta;
+    statement.head_end += delta;
+    if (statement.options_start >= 0) {
+        statement.options_start += delta;
+        statement.options_end += delta;
+    }
+}
+
+void shift(coordinateparser::index_range &range, int delta) {
+    range.first += delta;
+    range.last += delta;
+}
+
+// Command name, blanks and option list as "\\(draw|node)\s*(\[[^\]]*\])?" matches them.
+void read_head(QStringView s, coordinateparser::statement_ref &statement) {
+    const int open = skip_spaces(s, statement.start + 5);
+    statement.head_end = open;
+    if (!at_char(s, open, '[')) {
+        return;
+    }
+    int close = open + 1;
+    while (close < statement.end && s.at(close) != QLatin1Char(']')) {
+        ++close;
+    }
+    if (close >= statement.end) {
+        return;
+    }
+    statement.options_start = open;
+    statement.options_end = close + 1;
+    statement.head_end = close + 1;
+    int part_start = open + 1;
+    for (int i = open + 1; i <= close; ++i) {
+        if (i == close || s.at(i) == QLatin1Char(',')) {
+            if (i > part_start) {
+                statement.options << s.mid(part_start, i - part_start).trimmed().toString();
+            }
+            part_start = i + 1;
+        }
+    }
+}
+
+// Each "\draw" or "\node" that starts a command runs to the next ';'; offsets are relative to s.
+std::vector<coordinateparser::statement_ref> scan_statements(QStringView s) {
+    std::vector<coordinateparser::statement_ref> statements;
+    int command_start = -1;
+    for (int i = 0; i < s.size(); ++i) {
+        const QChar c = s.at(i);
+        if (c == QLatin1Char('\\') && command_start < 0 &&
+            (match_word(s, i + 1, QLatin1String("draw")) >= 0 || match_word(s, i + 1, QLatin1String("node")) >= 0)) {
+            command_start = i;
+        } else if (c == QLatin1Char(';') && command_start >= 0) {
+            coordinateparser::statement_ref statement;
+            statement.start = command_start;
+            statement.end = i + 1;
+            statement.node = s.at(command_start + 1) == QLatin1Char('n');
+            read_head(s, statement);
+            statements.push_back(std::move(statement));
+            command_start = -1;
+        }
+    }
+    return statements;
+}
+
+} // namespace
+
+namespace coordinateparser {
+
+parse_result parse(QStringView source) {
+    parse_result result;
+    const int n = static_cast<int>(source.size());
+
+    // Matches of one kind never overlap: a kind's next match may only start where its previous
+    // one ended, so "(a) rectangle (b) rectangle (c)" yields one rectangle.
+    int circle_resume = 0;
+    int ellipse_resume = 0;
+    int rectangle_resume = 0;
+    int bezier_resume = 0;
+
+    // A segment without an explicit start continues from the previous segment's end, unless a
+    // ';' closed the path in between.
     bool have_prev_end = false;
     double prev_x3 = 0.0;
     double prev_y3 = 0.0;
     int last_seg_end = 0;
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        bool ok_x0 = false;
-        bool ok_y0 = false;
-        bool ok_x1 = false;
-        bool ok_y1 = false;
-        bool ok_x2 = false;
-        bool ok_y2 = false;
-        bool ok_x3 = false;
-        bool ok_y3 = false;
-        const int seg_start = m.capturedStart(0);
-        if (seg_start > last_seg_end) {
-            const QString between = source.mid(last_seg_end, seg_start - last_seg_end);
-            if (between.contains(';')) {
-                have_prev_end = false;
-            }
-        }
+    int last_semicolon = -1;
 
-        const bool has_explicit_start = m.capturedStart(1) >= 0 && m.capturedStart(2) >= 0;
-        double x0 = 0.0;
-        double y0 = 0.0;
-        if (has_explicit_start) {
-            x0 = m.captured(1).toDouble(&ok_x0);
-            y0 = m.captured(2).toDouble(&ok_y0);
-        } else if (have_prev_end) {
-            ok_x0 = true;
-            ok_y0 = true;
-            x0 = prev_x3;
-            y0 = prev_y3;
-        }
-
-        const double x1 = m.captured(3).toDouble(&ok_x1);
-        const double y1 = m.captured(4).toDouble(&ok_y1);
-        const double x2 = m.captured(5).toDouble(&ok_x2);
-        const double y2 = m.captured(6).toDouble(&ok_y2);
-        const double x3 = m.captured(7).toDouble(&ok_x3);
-        const double y3 = m.captured(8).toDouble(&ok_y3);
-        if (!ok_x0 || !ok_y0 || !ok_x1 || !ok_y1 || !ok_x2 || !ok_y2 || !ok_x3 || !ok_y3) {
-            last_seg_end = m.capturedEnd(0);
-            continue;
+    const auto add_bezier = [&](int seg_start, int seg_end, const pair_token *start, const pair_token &c1,
+                                const pair_token &c2, const pair_token &end) {
+        if (last_semicolon >= last_seg_end && last_semicolon < seg_start) {
+            have_prev_end = false;
+        }
+        last_seg_end = seg_end;
+        bezier_resume = seg_end;
+        const bool start_ok = start != nullptr ? start->x.ok && start->y.ok : have_prev_end;
+        if (!start_ok || !c1.x.ok || !c1.y.ok || !c2.x.ok || !c2.y.ok || !end.x.ok || !end.y.ok) {
+            return;
         }
 
-        bezier_ref ref;
-        if (has_explicit_start) {
-            ref.x0_start = m.capturedStart(1);
-            ref.x0_end = ref.x0_start + m.capturedLength(1);
-            ref.y0_start = m.capturedStart(2);
-            ref.y0_end = ref.y0_start + m.capturedLength(2);
-        }
-        ref.x1_start = m.capturedStart(3);
-        ref.x1_end = ref.x1_start + m.capturedLength(3);
-        ref.y1_start = m.capturedStart(4);
-        ref.y1_end = ref.y1_start + m.capturedLength(4);
-        ref.x2_start = m.capturedStart(5);
-        ref.x2_end = ref.x2_start + m.capturedLength(5);
-        ref.y2_start = m.capturedStart(6);
-        ref.y2_end = ref.y2_start + m.capturedLength(6);
-        ref.x0 = x0;
-        ref.y0 = y0;
-        ref.x1 = x1;
-        ref.y1 = y1;
-        ref.x2 = x2;
-        ref.y2 = y2;
-        ref.x3 = x3;
-        ref.y3 = y3;
-        refs.push_back(ref);
+        // A continued segment starts at the previous end, which has no span of its own here.
+        const number_token x0 = start != nullptr ? start->x : number_token{-1, -1, prev_x3, true};
+        const number_token y0 = start != nullptr ? start->y : number_token{-1, -1, prev_y3, true};
+        append_row(result, primitive_kind::bezier, seg_start, seg_end, {x0, y0, c1.x, c1.y, c2.x, c2.y, end.x, end.y});
 
         have_prev_end = true;
-        prev_x3 = x3;
-        prev_y3 = y3;
-        last_seg_end = m.capturedEnd(0);
-    }
-    return refs;
-}
-
-std::vector<bezier_pair> extract_bezier_pairs(const QString &source) {
-    std::vector<bezier_pair> pairs;
-    const std::vector<bezier_ref> refs = extract_bezier_refs(source);
-    pairs.reserve(refs.size());
-    for (const bezier_ref &ref : refs) {
-        pairs.push_back({ref.x0, ref.y0, ref.x1, ref.y1, ref.x2, ref.y2, ref.x3, ref.y3});
-    }
-    return pairs;
-}
-
-std::vector<rectangle_ref> extract_rectangle_refs(const QString &source) {
-    std::vector<rectangle_ref> refs;
-    QRegularExpressionMatchIterator it = rectangle_pattern().globalMatch(source);
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        bool ok_x1 = false;
-        bool ok_y1 = false;
-        bool ok_x2 = false;
-        bool ok_y2 = false;
-        const double x1 = m.captured(1).toDouble(&ok_x1);
-        const double y1 = m.captured(2).toDouble(&ok_y1);
-        const double x2 = m.captured(3).toDouble(&ok_x2);
-        const double y2 = m.captured(4).toDouble(&ok_y2);
-        if (!ok_x1 || !ok_y1 || !ok_x2 || !ok_y2) {
+        prev_x3 = end.x.value;
+        prev_y3 = end.y.value;
+    };
+
+    for (int i = 0; i < n; ++i) {
+        const QChar c = source.at(i);
+        if (c == QLatin1Char(';')) {
+            last_semicolon = i;
             continue;
         }
+        if (c == QLatin1Char('.')) {
+            if (i + 1 >= n || source.at(i + 1) != QLatin1Char('.')) {
+                continue;
+            }
+            pair_token c1;
+            pair_token c2;
+            pair_token end;
+            int seg_end = -1;
+            if (i >= bezier_resume && (seg_end = match_bezier_tail(source, i, c1, c2, end)) >= 0) {
+                add_bezier(i, seg_end, nullptr, c1, c2, end);
+            }
+            continue;
+        }
+        if (c != QLatin1Char('(')) {
+            continue;
+        }
+        pair_token p;
+        if (!match_pair(source, i, p)) {
+            continue;
+        }
+        const bool p_ok = p.x.ok && p.y.ok;
+        if (p_ok) {
+            append_row(result, primitive_kind::coordinate, p.start, p.end, {p.x, p.y});
+        }
+
+        number_token r;
+        int end = -1;
+        if (i >= circle_resume && (end = match_circle_tail(source, p.end, r)) >= 0) {
+            circle_resume = end;
+            if (p_ok && r.ok) {
+                append_row(result, primitive_kind::circle, p.start, end, {p.x, p.y, r});
+            }
+        }
+
+        number_token rx;
+        number_token ry;
+        if (i >= ellipse_resume && (end = match_ellipse_tail(source, p.end, rx, ry)) >= 0) {
+            ellipse_resume = end;
+            if (p_ok && rx.ok && ry.ok) {
+                append_row(result, primitive_kind::ellipse, p.start, end, {p.x, p.y, rx, ry});
+            }
+        }
 
-        rectangle_ref ref;
-        ref.x1_start = m.capturedStart(1);
-        ref.x1_end = ref.x1_start + m.capturedLength(1);
-        ref.y1_start = m.capturedStart(2);
-        ref.y1_end = ref.y1_start + m.capturedLength(2);
-        ref.x2_start = m.capturedStart(3);
-        ref.x2_end = ref.x2_start + m.capturedLength(3);
-        ref.y2_start = m.capturedStart(4);
-        ref.y2_end = ref.y2_start + m.capturedLength(4);
-        ref.x1 = x1;
-        ref.y1 = y1;
-        ref.x2 = x2;
-        ref.y2 = y2;
-        refs.push_back(ref);
+        pair_token corner;
+        if (i >= rectangle_resume && (end = match_rectangle_tail(source, p.end, corner)) >= 0) {
+            rectangle_resume = end;
+            if (p_ok && corner.x.ok && corner.y.ok) {
+                append_row(result, primitive_kind::rectangle, p.start, end, {p.x, p.y, corner.x, corner.y});
+            }
+        }
+
+        pair_token c1;
+        pair_token c2;
+        pair_token seg_end_pair;
+        if (i >= bezier_resume &&
+            (end = match_bezier_tail(source, skip_spaces(source, p.end), c1, c2, seg_end_pair)) >= 0) {
+            add_bezier(i, end, &p, c1, c2, seg_end_pair);
+        }
+        // Nothing else can start inside the pair itself.
+        i = p.end - 1;
     }
-    return refs;
+    return result;
 }
 
-std::vector<rectangle_pair> extract_rectangle_pairs(const QString &source) {
-    std::vector<rectangle_pair> pairs;
-    const std::vector<rectangle_ref> refs = extract_rectangle_refs(source);
-    pairs.reserve(refs.size());
-    for (const rectangle_ref &ref : refs) {
-        pairs.push_back({ref.x1, ref.y1, ref.x2, ref.y2});
+void document_index::reset(QStringView source) {
+    merge_rows(parse(source), static_cast<int>(source.size()) - length_);
+    statements_ = scan_statements(source);
+    for (statement_ref &statement : statements_) {
+        assign_primitives(statement);
+    }
+    length_ = static_cast<int>(source.size());
+    semicolons_.clear();
+    for (int i = 0; i < length_; ++i) {
+        if (source.at(i) == QLatin1Char(';')) {
+            semicolons_.push_back(i);
+        }
     }
-    return pairs;
 }
 
-QString format_number(double value) {
-    QString s = QString::number(value, 'f', 4);
+void document_index::adopt(document_index &&parsed) {
+    merge_rows(std::move(parsed.primitives_), parsed.length_ - length_);
+    // The merged rows are the parsed rows in the same order, so the statements' row ranges hold.
+    statements_ = std::move(parsed.statements_);
+    semicolons_ = std::move(parsed.semicolons_);
+    length_ = parsed.length_;
+}
+
+bool document_index::affected_range(int position, int removed, int added, int &start, int &end) const {
+    if (position < 0 || removed < 0 || added < 0 || position + removed > length_) {
+        return false;
+    }
+    // From after the last ';' before the change to the first ';' the change did not remove.
+    const auto first = std::lower_bound(semicolons_.begin(), semicolons_.end(), position);
+    const auto last = std::lower_bound(first, semicolons_.end(), position + removed);
+    start = first == semicolons_.begin() ? 0 : *std::prev(first) + 1;
+    const int old_end = last == semicolons_.end() ? length_ : *last + 1;
+    end = old_end + added - removed;
+    return true;
+}
+
+void document_index::apply_change(int position, int removed, int added, QStringView affected_text) {
+    int start = 0;
+    int end = 0;
+    if (!affected_range(position, removed, added, start, end)) {
+        return;
+    }
+    const int delta = added - removed;
+    const int old_end = end - delta;
+
+    primitive_table fresh = parse(affected_text);
+    shift_rows(fresh, 0, fresh.size(), start);
+    const index_range old_rows = rows_within(primitives_, start, old_end);
+    match_ids(primitives_, old_rows.first, old_rows.last, fresh, 0, fresh.size(), next_id_);
+    shift_rows(primitives_, old_rows.last, primitives_.size(), delta);
+    replace_primitives(old_rows.first, old_rows.last, fresh, 0, fresh.size());
+    const int row_delta = fresh.size() - (old_rows.last - old_rows.first);
+
+    std::vector<int> fresh_semicolons;
+    for (int i = 0; i < affected_text.size(); ++i) {
+        if (affected_text.at(i) == QLatin1Char(';')) {
+            fresh_semicolons.push_back(start + i);
+        }
+    }
+    const auto first = std::lower_bound(semicolons_.begin(), semicolons_.end(), start);
+    const auto last = std::lower_bound(first, semicolons_.end(), old_end);
+    for (auto it = last; it != semicolons_.end(); ++it) {
+        *it += delta;
+    }
+    semicolons_.insert(semicolons_.erase(first, last), fresh_semicolons.begin(), fresh_semicolons.end());
+    length_ += delta;
+
+    // Statements end at a ';', so none crosses the boundaries of the re-lexed range.
+    const auto starts_before = [](const statement_ref &statement, int pos) { return statement.start < pos; };
+    const auto first_statement = std::lower_bound(statements_.begin(), statements_.end(), start, starts_before);
+    const auto last_statement = std::lower_bound(first_statement, statements_.end(), old_end, starts_before);
+    for (auto it = last_statement; it != statements_.end(); ++it) {
+        shift(*it, delta);
+        shift(it->primitives, row_delta);
+    }
+    std::vector<statement_ref> fresh_statements = scan_statements(affected_text);
+    for (statement_ref &statement : fresh_statements) {
+        shift(statement, start);
+        assign_primitives(statement);
+    }
+    statements_.insert(statements_.erase(first_statement, last_statement),
+                       std::make_move_iterator(fresh_statements.begin()),
+                       std::make_move_iterator(fresh_statements.end()));
+}
+
+const statement_ref *document_index::statement_at(int position) const {
+    const auto after = std::upper_bound(
+        statements_.begin(), statements_.end(), position, [](int pos, const statement_ref &statement) {
+            return pos < statement.start;
+        });
+    if (after == statements_.begin() || position >= std::prev(after)->end) {
+        return nullptr;
+    }
+    return &*std::prev(after);
+}
+
+primitive_snapshot_ptr document_index::snapshot() const {
+    return std::make_shared<const primitive_table>(primitives_);
+}
+
+void document_index::assign_primitives(statement_ref &statement) const {
+    statement.primitives = rows_within(primitives_, statement.start, statement.end);
+}
+
+void document_index::merge_rows(primitive_table &&fresh, int delta) {
+    // Rows before and after the changed text come out of a whole reparse exactly as they are
+    // here, apart from the shift of those after it; only the rows in between are replaced.
+    const int old_count = primitives_.size();
+    const int new_count = fresh.size();
+    int head = 0;
+    while (head < old_count && head < new_count && same_row(primitives_, head, fresh, head, 0)) {
+        ++head;
+    }
+    int tail = 0;
+    while (tail < old_count - head && tail < new_count - head &&
+           same_row(primitives_, old_count - 1 - tail, fresh, new_count - 1 - tail, delta)) {
+        ++tail;
+    }
+    match_ids(primitives_, head, old_count - tail, fresh, head, new_count - tail, next_id_);
+    shift_rows(primitives_, old_count - tail, old_count, delta);
+    replace_primitives(head, old_count - tail, fresh, head, new_count - tail - head);
+}
+
+void document_index::replace_primitives(int first,
+                                        int last,
+                                        const primitive_table &fresh,
+                                        int fresh_first,
+                                        int fresh_count) {
+    for (int row = first; row < last; ++row) {
+        row_by_id_.remove(primitives_.id[row]);
+    }
+    replace_rows(primitives_, first, last, fresh, fresh_first, fresh_first + fresh_count);
+    const int row_delta = fresh_count - (last - first);
+
+    // Rows after the replaced ones keep their ids and kinds but move by row_delta.
+    const int renumber_end = row_delta == 0 ? first + fresh_count : primitives_.size();
+    for (int row = first; row < renumber_end; ++row) {
+        row_by_id_.insert(primitives_.id[row], row);
+    }
+    std::vector<int> added;
+    for (int k = 0; k < kind_count; ++k) {
+        std::vector<int> &rows = kind_rows_[k];
+        const auto removed_first = std::lower_bound(rows.begin(), rows.end(), first);
+        const auto removed_last = std::lower_bound(removed_first, rows.end(), last);
+        if (row_delta != 0) {
+            for (auto it = removed_last; it != rows.end(); ++it) {
+                *it += row_delta;
+            }
+        }
+        added.clear();
+        for (int row = first; row < first + fresh_count; ++row) {
+            if (static_cast<int>(primitives_.kind[row]) == k) {
+                added.push_back(row);
+            }
+        }
+        replace_column(rows,
+                       static_cast<int>(removed_first - rows.begin()),
+                       static_cast<int>(removed_last - rows.begin()),
+                       added,
+                       0,
+                       static_cast<int>(added.size()));
+    }
+}
+
+int document_index::kind_ordinal(int row) const {
+    const std::vector<int> &rows = kind_rows_[static_cast<int>(primitives_.kind[row])];
+    return static_cast<int>(std::lower_bound(rows.begin(), rows.end(), row) - rows.begin()) + 1;
+}
+
+QString format_number(double value, int precision) {
+    precision = qMax(0, precision);
+#if defined(__cpp_lib_to_chars)
+    char buffer[64];
+    const auto [end, error] =
+        std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, precision);
+    if (error == std::errc()) {
+        const char *last = end;
+        if (std::find(buffer, end, '.') != end) {
+            while (last[-1] == '0') {
+                --last;
+            }
+            if (last[-1] == '.') {
+                --last;
+            }
+        }
+        if (last - buffer == 2 && buffer[0] == '-' && buffer[1] == '0') {
+            return QStringLiteral("0");
+        }
+        return QString::fromLatin1(buffer, last - buffer);
+    }
+#endif
+    QString s = QString::number(value, 'f', precision);
     while (s.contains('.') && (s.endsWith('0') || s.endsWith('.'))) {
         s.chop(1);
     }
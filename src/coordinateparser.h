@@ -1,24 +1,86 @@
 #ifndef COORDINATEPARSER_H
 #define COORDINATEPARSER_H
 
+#include <QHash>
 #include <QString>
+#include <QStringList>
+#include <QStringView>
+#include <array>
 #include <vector>
 
 #include "model.h"
 
 namespace coordinateparser {
 
-std::vector<coord_ref> extract_refs(const QString &source);
-std::vector<coord_pair> extract_pairs(const QString &source);
-std::vector<circle_ref> extract_circle_refs(const QString &source);
-std::vector<circle_pair> extract_circle_pairs(const QString &source);
-std::vector<ellipse_ref> extract_ellipse_refs(const QString &source);
-std::vector<ellipse_pair> extract_ellipse_pairs(const QString &source);
-std::vector<bezier_ref> extract_bezier_refs(const QString &source);
-std::vector<bezier_pair> extract_bezier_pairs(const QString &source);
-std::vector<rectangle_ref> extract_rectangle_refs(const QString &source);
-std::vector<rectangle_pair> extract_rectangle_pairs(const QString &source);
-QString format_number(double value);
+// Every primitive found in one pass over the source.
+using parse_result = primitive_table;
+
+// Rows [first, last) of a primitive table.
+struct index_range {
+    int first = 0;
+    int last = 0;
+};
+
+// A "\draw" or "\node" command up to the first ';' after it.
+struct statement_ref {
+    int start = 0;
+    int end = 0;
+    // After the command name and its option list, or after the blanks following the name.
+    int head_end = 0;
+    bool node = false;
+    // The "[...]" option list, -1 when the command has none.
+    int options_start = -1;
+    int options_end = -1;
+    QStringList options;
+    index_range primitives;
+};
+
+parse_result parse(QStringView source);
+
+// Primitives of an edited document kept current across edits. No primitive spans a ';', so a
+// change only re-lexes the statements it touches and shifts the offsets of everything after it.
+class document_index {
+public:
+    void reset(QStringView source);
+    // Takes over an index built elsewhere from the current text, keeping the ids of the rows it
+    // still recognizes.
+    void adopt(document_index &&parsed);
+    // Range [start, end) of the changed document that apply_change() needs for
+    // contentsChange(position, removed, added); false if the change does not fit the indexed text.
+    bool affected_range(int position, int removed, int added, int &start, int &end) const;
+    void apply_change(int position, int removed, int added, QStringView affected_text);
+
+    int length() const { return length_; }
+    const primitive_table &primitives() const { return primitives_; }
+    const std::vector<statement_ref> &statements() const { return statements_; }
+    primitive_snapshot_ptr snapshot() const;
+    // The statement containing position, or nullptr.
+    const statement_ref *statement_at(int position) const;
+    // Row of the primitive with the given id, or -1.
+    int row_of(quint32 primitive_id) const { return row_by_id_.value(primitive_id, -1); }
+    // 1-based position of a row among the rows of its kind.
+    int kind_ordinal(int row) const;
+
+private:
+    static constexpr int kind_count = static_cast<int>(primitive_kind::rectangle) + 1;
+
+    void assign_primitives(statement_ref &statement) const;
+    void merge_rows(primitive_table &&fresh, int delta);
+    // Replaces rows [first, last) with the first fresh_count rows of fresh.
+    void replace_primitives(int first, int last, const primitive_table &fresh, int fresh_first, int fresh_count);
+
+    primitive_table primitives_;
+    // Kept in step with primitives_: the row of every id, and the rows of each kind in order.
+    QHash<quint32, int> row_by_id_;
+    std::array<std::vector<int>, kind_count> kind_rows_;
+    std::vector<statement_ref> statements_;
+    std::vector<int> semicolons_;
+    int length_ = 0;
+    quint32 next_id_ = 1;
+};
+
+// Fixed notation rounded to precision decimals, without trailing zeros.
+QString format_number(double value, int precision = 4);
 
 } // namespace coordinateparser
 
@@ -0,0 +1,172 @@
+#include "latencytracker.h"
+
+#include <QStringList>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace {
+
+// Completed generations kept for the percentiles and the CSV export.
+constexpr std::size_t history_size = 200;
+// Generations that never reach the preview (failed, canceled, superseded) are dropped past this.
+constexpr std::size_t open_limit = 64;
+
+} // namespace
+
+latencytracker::latencytracker(QObject *parent) : QObject(parent) {}
+
+qint64 latencytracker::now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+QString latencytracker::phase_name(int phase) {
+    static const char *names[phase_count] = {"Editor change",
+                                             "Parse",
+                                             "Timer fire",
+                                             "Inject calibration",
+                                             "TeX write",
+                                             "Process spawn",
+                                             "First output",
+                                             "Process exit",
+                                             "Load PDF",
+                                             "First render",
+                                             "Calibration"};
+    if (phase < 0 || phase >= phase_count) {
+        return QString();
+    }
+    return QString::fromLatin1(names[phase]);
+}
+
+latencytracker::phase_times latencytracker::empty_times() {
+    phase_times times;
+    times.fill(-1);
+    return times;
+}
+
+void latencytracker::mark_pending(latency_phase phase) {
+    pending_[static_cast<int>(phase)] = now_us();
+}
+
+void latencytracker::begin(quint64 generation) {
+    phase_times &times = open_.try_emplace(generation, empty_times()).first->second;
+    for (int i = 0; i < phase_count; ++i) {
+        if (times[i] < 0) {
+            times[i] = pending_[i];
+        }
+    }
+    pending_ = empty_times();
+    while (open_.size() > open_limit) {
+        open_.erase(open_.begin());
+    }
+}
+
+void latencytracker::discard_pending() {
+    pending_ = empty_times();
+}
+
+void latencytracker::mark(quint64 generation, int phase, qint64 timestamp_us) {
+    if (phase < 0 || phase >= phase_count) {
+        return;
+    }
+    if (!completed_.empty() && generation <= completed_.back().first) {
+        return;
+    }
+    phase_times &times = open_.try_emplace(generation, empty_times()).first->second;
+    if (times[phase] < 0) {
+        times[phase] = timestamp_us;
+    }
+    if (phase == static_cast<int>(latency_phase::calibration)) {
+        complete(generation);
+    }
+}
+
+void latencytracker::complete(quint64 generation) {
+    const auto it = open_.find(generation);
+    if (it == open_.end()) {
+        return;
+    }
+    completed_.emplace_back(generation, it->second);
+    // Older generations can no longer be shown.
+    open_.erase(open_.begin(), std::next(it));
+    while (completed_.size() > history_size) {
+        completed_.pop_front();
+    }
+    emit updated();
+}
+
+void latencytracker::clear() {
+    pending_ = empty_times();
+    open_.clear();
+    completed_.clear();
+    emit updated();
+}
+
+latency_stats latencytracker::summarize(std::vector<double> &values_ms) {
+    latency_stats stats;
+    stats.samples = static_cast<int>(values_ms.size());
+    if (values_ms.empty()) {
+        return stats;
+    }
+    std::sort(values_ms.begin(), values_ms.end());
+    // Nearest-rank percentiles.
+    const auto rank = [&values_ms](double p) {
+        const auto index = static_cast<std::size_t>(std::ceil(p * static_cast<double>(values_ms.size()))) - 1;
+        return values_ms[std::min(index, values_ms.size() - 1)];
+    };
+    stats.p50_ms = rank(0.50);
+    stats.p95_ms = rank(0.95);
+    stats.max_ms = values_ms.back();
+    return stats;
+}
+
+latency_stats latencytracker::phase_stats(int phase) const {
+    std::vector<double> values;
+    for (const auto &[generation, times] : completed_) {
+        Q_UNUSED(generation)
+        if (phase < 0 || phase >= phase_count || times[phase] < 0) {
+            continue;
+        }
+        for (int previous = phase - 1; previous >= 0; --previous) {
+            if (times[previous] >= 0) {
+                values.push_back(static_cast<double>(times[phase] - times[previous]) / 1000.0);
+                break;
+            }
+        }
+    }
+    return summarize(values);
+}
+
+latency_stats latencytracker::total_stats() const {
+    std::vector<double> values;
+    for (const auto &[generation, times] : completed_) {
+        Q_UNUSED(generation)
+        const auto first = std::find_if(times.begin(), times.end(), [](qint64 t) { return t >= 0; });
+        if (first != times.end()) {
+            values.push_back(static_cast<double>(times[phase_count - 1] - *first) / 1000.0);
+        }
+    }
+    return summarize(values);
+}
+
+QString latencytracker::to_csv() const {
+    // One row per generation; each phase is in milliseconds from the generation's first phase.
+    QStringList header{"generation"};
+    for (int i = 0; i < phase_count; ++i) {
+        header << phase_name(i).toLower().replace(' ', '_') + "_ms";
+    }
+    header << "total_ms";
+
+    QString csv = header.join(',') + '\n';
+    for (const auto &[generation, times] : completed_) {
+        const auto first = std::find_if(times.begin(), times.end(), [](qint64 t) { return t >= 0; });
+        QStringList row{QString::number(generation)};
+        for (const qint64 t : times) {
+            row << (t < 0 ? QString() : QString::number(static_cast<double>(t - *first) / 1000.0, 'f', 3));
+        }
+        row << QString::number(static_cast<double>(times[phase_count - 1] - *first) / 1000.0, 'f', 3);
+        csv += row.join(',') + '\n';
+    }
+    return csv;
+}
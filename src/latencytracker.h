@@ -0,0 +1,77 @@
+#ifndef LATENCYTRACKER_H
+#define LATENCYTRACKER_H
+
+#include <QObject>
+#include <QString>
+#include <array>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Steps between an edit and a calibrated preview, in the order they normally happen.
+enum class latency_phase : int {
+    editor_change,
+    // The primitive index describes the edited text; compiles do not wait for it.
+    parse,
+    timer_fire,
+    inject,
+    tex_write,
+    process_spawn,
+    first_output,
+    process_exit,
+    load_pdf,
+    first_render,
+    calibration,
+    count
+};
+
+struct latency_stats {
+    double p50_ms = 0.0;
+    double p95_ms = 0.0;
+    double max_ms = 0.0;
+    int samples = 0;
+};
+
+// Collects phase timestamps per compile generation and keeps a rolling window of completed
+// generations. Timestamps come from a monotonic clock shared by all threads; marks made from
+// other threads are delivered to the GUI thread as signal arguments.
+class latencytracker : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr int phase_count = static_cast<int>(latency_phase::count);
+    // Microseconds on the monotonic clock; -1 for phases a generation did not go through.
+    using phase_times = std::array<qint64, phase_count>;
+
+    explicit latencytracker(QObject *parent = nullptr);
+
+    static qint64 now_us();
+    static QString phase_name(int phase);
+
+    // Phases before a compile exists are held until begin() gives them a generation.
+    void mark_pending(latency_phase phase);
+    void begin(quint64 generation);
+    void discard_pending();
+    void mark(quint64 generation, int phase, qint64 timestamp_us);
+    void clear();
+
+    // Time from the previous phase a generation went through, or from its first phase for the total.
+    latency_stats phase_stats(int phase) const;
+    latency_stats total_stats() const;
+    QString to_csv() const;
+
+signals:
+    void updated();
+
+private:
+    static phase_times empty_times();
+    static latency_stats summarize(std::vector<double> &values_ms);
+    void complete(quint64 generation);
+
+    phase_times pending_ = empty_times();
+    std::map<quint64, phase_times> open_;
+    std::deque<std::pair<quint64, phase_times>> completed_;
+};
+
+#endif
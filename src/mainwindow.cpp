@@ -1,6 +1,7 @@
 #include "mainwindow.h"
 
 #include <algorithm>
+#include <utility>
 #include <QAction>
 #include <QApplication>
 #include <QComboBox>
@@ -47,11 +48,23 @@
 
 #include "compileservice.h"
 #include "coordinateparser.h"
+#include "latencytracker.h"
 #include "pdfcanvas.h"
 #include "appconfig.h"
 #include "settingsdialog.h"
+#include "sourcefingerprint.h"
+#include "timingpanel.h"
 
 namespace {
+
+// Bounds of the auto-compile delay, matching the settings dialog.
+constexpr int min_auto_compile_delay_ms = 100;
+constexpr int max_auto_compile_delay_ms = 3000;
+// Gaps between edits longer than this are pauses rather than typing rhythm.
+constexpr qint64 typing_pause_ms = 1500;
+// Sources and edits longer than this are parsed on the parse thread instead of the GUI thread.
+constexpr int background_parse_chars = 1 << 16;
+
 class linenumberedit;
 class verticaltoolbutton : public QToolButton {
 public:
@@ -297,8 +310,15 @@ mainwindow::mainwindow(QWidget *parent) : QMainWindow(parent) {
     editor_->setTabStopDistance(editor_->fontMetrics().horizontalAdvance(QStringLiteral(" ")) * 4);
     editor_->setPlainText(minimal_tikz_document_text());
     editor_->document()->setModified(false);
+    parse_worker_ = new parseworker;
+    parse_worker_->moveToThread(&parse_thread_);
+    connect(&parse_thread_, &QThread::finished, parse_worker_, &QObject::deleteLater);
+    connect(parse_worker_, &parseworker::parsed, this, &mainwindow::on_source_parsed);
+    parse_thread_.start();
     connect(editor_->document(), &QTextDocument::modificationChanged, this, &mainwindow::on_document_modified_changed);
+    connect(editor_->document(), &QTextDocument::contentsChange, this, &mainwindow::on_editor_contents_change);
     connect(editor_, &QPlainTextEdit::textChanged, this, &mainwindow::on_editor_text_changed);
+    source_index_.reset(editor_->toPlainText());
     new latexhighlighter(editor_->document());
     update_window_title();
 
@@ -599,10 +619,13 @@ mainwindow::mainwindow(QWidget *parent) : QMainWindow(parent) {
     setCentralWidget(central);
 
     compile_service_ = new compileservice(this);
+    latency_tracker_ = new latencytracker(this);
+    timing_panel_ = new timingpanel(latency_tracker_, this);
+    addDockWidget(Qt::RightDockWidgetArea, timing_panel_);
+    timing_panel_->hide();
 
     auto_compile_timer_ = new QTimer(this);
     auto_compile_timer_->setSingleShot(true);
-    auto_compile_timer_->setInterval(auto_compile_delay_ms_);
     connect(auto_compile_timer_, &QTimer::timeout, this, &mainwindow::on_auto_compile_timeout);
 
     connect(preview_canvas_, &pdfcanvas::coordinate_dragged, this, &mainwindow::on_coordinate_dragged);
@@ -612,13 +635,18 @@ mainwindow::mainwindow(QWidget *parent) : QMainWindow(parent) {
     connect(preview_canvas_, &pdfcanvas::rectangle_corner_dragged, this, &mainwindow::on_rectangle_corner_dragged);
     connect(preview_canvas_, &pdfcanvas::selection_changed, this, &mainwindow::on_canvas_selection_changed);
     connect(preview_canvas_, &pdfcanvas::add_point_clicked, this, &mainwindow::on_canvas_add_point);
+    connect(preview_canvas_, &pdfcanvas::pdf_shown, this, &mainwindow::on_preview_shown);
+    connect(preview_canvas_, &pdfcanvas::pdf_load_failed, this, &mainwindow::on_preview_load_failed);
     connect(grid_step_combo_, &QComboBox::currentIndexChanged, this, &mainwindow::on_grid_step_changed);
     connect(grid_extent_spin_, &QSpinBox::valueChanged, this, &mainwindow::on_grid_extent_changed);
 
     connect(compile_service_, &compileservice::output_text, this, &mainwindow::on_compile_service_output);
     connect(compile_service_, &compileservice::compile_finished, this, &mainwindow::on_compile_finished);
+    connect(compile_service_, &compileservice::phase_reached, latency_tracker_, &latencytracker::mark);
+    connect(preview_canvas_, &pdfcanvas::phase_reached, latency_tracker_, &latencytracker::mark);
 
     preview_canvas_->set_snap_mm(grid_snap_mm_);
+    preview_canvas_->set_grid(grid_display_mm_, grid_extent_cm_);
     load_settings();
 
     create_menu_and_toolbar();
@@ -633,6 +661,11 @@ mainwindow::mainwindow(QWidget *parent) : QMainWindow(parent) {
     connect(left_node_button_, &QPushButton::clicked, this, &mainwindow::start_add_node_mode);
 }
 
+mainwindow::~mainwindow() {
+    parse_thread_.quit();
+    parse_thread_.wait();
+}
+
 void mainwindow::closeEvent(QCloseEvent *event) {
     if (maybe_save_before_action("Quit", "Save changes before quitting?")) {
         event->accept();
@@ -678,52 +711,166 @@ bool mainwindow::maybe_save_before_action(const QString &title, const QString &t
     return !editor_->document()->isModified();
 }
 
-void mainwindow::request_compile(bool cancel_running) {
+void mainwindow::request_compile(bool force) {
     if (!compile_service_ || !editor_) {
         return;
     }
-    if (compile_service_->is_busy()) {
-        pending_compile_ = true;
-        if (cancel_running) {
-            compile_service_->cancel();
-        }
+
+    const QString source_text = editor_->toPlainText();
+    // A snapshot still being parsed reaches the canvas when it is installed.
+    if (index_revision_ == source_revision_) {
+        update_canvas_primitives();
+    }
+
+    const QString fingerprint = sourcefingerprint::compute(source_text, compile_service_->compiler_command());
+    const bool preview_current = pending_shown_generation_ != 0 ? fingerprint == pending_shown_fingerprint_
+                                                                : fingerprint == shown_fingerprint_;
+    if (!force && preview_current) {
+        // Only comments or layout changed: the preview on screen is still current, and anything
+        // compiling now would replace it with an older state.
+        compile_service_->cancel();
+        discarded_generation_ = requested_generation_;
+        latency_tracker_->discard_pending();
+        statusBar()->showMessage("Source unchanged, preview kept", 1500);
         return;
     }
 
-    const QString source_text = editor_->toPlainText();
-    coordinate_refs_ = coordinateparser::extract_refs(source_text);
-    circle_refs_ = coordinateparser::extract_circle_refs(source_text);
-    ellipse_refs_ = coordinateparser::extract_ellipse_refs(source_text);
-    bezier_refs_ = coordinateparser::extract_bezier_refs(source_text);
-    rectangle_refs_ = coordinateparser::extract_rectangle_refs(source_text);
-    update_properties_panel();
-    preview_canvas_->set_coordinates(coordinateparser::extract_pairs(source_text));
-    preview_canvas_->set_circles(coordinateparser::extract_circle_pairs(source_text));
-    preview_canvas_->set_ellipses(coordinateparser::extract_ellipse_pairs(source_text));
-    preview_canvas_->set_beziers(coordinateparser::extract_bezier_pairs(source_text));
-    preview_canvas_->set_rectangles(coordinateparser::extract_rectangle_pairs(source_text));
-    compile_service_->compile(source_text, grid_display_mm_, grid_extent_cm_);
+    requested_generation_ = compile_service_->compile(source_text);
+    latency_tracker_->begin(requested_generation_);
+    requested_fingerprints_[requested_generation_] = fingerprint;
     statusBar()->showMessage("Compiling...");
 }
 
+void mainwindow::update_canvas_primitives() {
+    canvas_primitives_ = source_index_.snapshot();
+    preview_canvas_->set_primitives(canvas_primitives_);
+}
+
 void mainwindow::replace_editor_text_preserve_undo(const QString &text) {
     suppress_auto_compile_ = true;
     editor_->setPlainText(text);
     suppress_auto_compile_ = false;
 }
 
+void mainwindow::replace_editor_range(int start, int end, const QString &text) {
+    QTextCursor cursor(editor_->document());
+    cursor.setPosition(start);
+    cursor.setPosition(end, QTextCursor::KeepAnchor);
+    suppress_auto_compile_ = true;
+    cursor.insertText(text);
+    suppress_auto_compile_ = false;
+}
+
+void mainwindow::on_editor_contents_change(int position, int removed, int added) {
+    // Marked here rather than on textChanged, which only follows the index update below.
+    if (auto_compile_timer_ && !suppress_auto_compile_) {
+        latency_tracker_->mark_pending(latency_phase::editor_change);
+    }
+    ++source_revision_;
+    QTextDocument *document = editor_->document();
+    const int length = document->characterCount() - 1;
+    int start = 0;
+    int end = 0;
+    // setPlainText() and some undo steps report a change that includes the final paragraph
+    // separator, which the indexed text does not have.
+    const bool fits = !parse_in_flight_ && index_revision_ + 1 == source_revision_ &&
+                      source_index_.affected_range(position, removed, added, start, end) &&
+                      source_index_.length() - removed + added == length;
+    if (fits && end - start <= background_parse_chars) {
+        QTextCursor cursor(document);
+        cursor.setPosition(start);
+        cursor.setPosition(end, QTextCursor::KeepAnchor);
+        // Same text toPlainText() would give for the range.
+        QString text = cursor.selectedText();
+        text.replace(QChar::ParagraphSeparator, QLatin1Char('\n'))
+            .replace(QChar::LineSeparator, QLatin1Char('\n'))
+            .replace(QChar::Nbsp, QLatin1Char(' '));
+        source_index_.apply_change(position, removed, added, text);
+        index_revision_ = source_revision_;
+        if (latency_tracker_) {
+            latency_tracker_->mark_pending(latency_phase::parse);
+        }
+        return;
+    }
+    if (length <= background_parse_chars) {
+        source_index_.reset(editor_->toPlainText());
+        index_revision_ = source_revision_;
+        if (latency_tracker_) {
+            latency_tracker_->mark_pending(latency_phase::parse);
+        }
+        return;
+    }
+    request_background_parse();
+}
+
+void mainwindow::request_background_parse() {
+    // One snapshot at a time; edits made meanwhile are picked up when its result comes back.
+    if (parse_in_flight_) {
+        return;
+    }
+    parse_in_flight_ = true;
+    QMetaObject::invokeMethod(
+        parse_worker_,
+        [worker = parse_worker_, revision = source_revision_, source = editor_->toPlainText()]() {
+            worker->parse(revision, source);
+        },
+        Qt::QueuedConnection);
+}
+
+void mainwindow::on_source_parsed(quint64 revision, const document_index_ptr &index) {
+    parse_in_flight_ = false;
+    if (revision != source_revision_) {
+        if (index_revision_ != source_revision_) {
+            request_background_parse();
+        }
+        return;
+    }
+    source_index_.adopt(std::move(*index));
+    index_revision_ = revision;
+    // Once the compile for this edit has begun, the parse is no longer part of its timeline.
+    if (auto_compile_timer_->isActive()) {
+        latency_tracker_->mark_pending(latency_phase::parse);
+    }
+    update_properties_panel();
+    update_canvas_primitives();
+}
+
 void mainwindow::on_editor_text_changed() {
     update_properties_panel();
     if (suppress_auto_compile_) {
         return;
     }
     if (auto_compile_timer_) {
-        auto_compile_timer_->start();
+        const qint64 gap = last_edit_timer_.isValid() ? last_edit_timer_.elapsed() : typing_pause_ms;
+        last_edit_timer_.start();
+        if (gap < typing_pause_ms) {
+            const double gap_ms = static_cast<double>(gap);
+            typing_interval_ms_ = typing_interval_ms_ > 0.0 ? 0.8 * typing_interval_ms_ + 0.2 * gap_ms : gap_ms;
+        }
+        auto_compile_timer_->start(auto_compile_delay());
     }
 }
 
+int mainwindow::auto_compile_delay() const {
+    if (!adaptive_auto_compile_ || typing_interval_ms_ <= 0.0) {
+        return auto_compile_delay_ms_;
+    }
+    // The user has most likely stopped typing after a few of their usual keystroke gaps.
+    const double pause_ms = 2.5 * typing_interval_ms_;
+    const double compile_ms = compile_service_->average_compile_ms();
+    if (compile_ms <= auto_compile_delay_ms_) {
+        // A compile started too early costs little, so the configured delay is only a ceiling.
+        return qBound(min_auto_compile_delay_ms, static_cast<int>(pause_ms), auto_compile_delay_ms_);
+    }
+    // A slow compile started mid-word would be canceled by the next keystroke; wait for a more
+    // certain pause, with the configured delay as a floor.
+    return qBound(
+        auto_compile_delay_ms_, static_cast<int>(pause_ms + 0.25 * compile_ms), max_auto_compile_delay_ms);
+}
+
 void mainwindow::on_auto_compile_timeout() {
-    request_compile(true);
+    latency_tracker_->mark_pending(latency_phase::timer_fire);
+    request_compile();
 }
 
 void mainwindow::toggle_left_panel() {
@@ -919,7 +1066,7 @@ void mainwindow::on_canvas_add_point(double x, double y) {
     text.insert(pos, cmd);
     replace_editor_text_preserve_undo(text);
     set_add_object_mode(QString());
-    request_compile(true);
+    request_compile();
 }
 
 void mainwindow::create_menu_and_toolbar() {
@@ -997,9 +1144,7 @@ void mainwindow::create_menu_and_toolbar() {
             }
             replace_editor_text_preserve_undo(wrap_tikz_document(body));
             statusBar()->showMessage("Loaded example: " + label, 1500);
-            if (compile_service_ && !compile_service_->is_busy()) {
-                compile();
-            }
+            compile();
         });
         examples_menu->addAction(act);
     };
@@ -1037,6 +1182,7 @@ void mainwindow::create_menu_and_toolbar() {
     edit_menu->addSeparator();
     edit_menu->addAction(settings_act);
     view_menu->addAction(left_panel_act);
+    view_menu->addAction(timing_panel_->toggleViewAction());
     build_menu->addAction(compile_act);
     build_menu->addAction(indent_act);
     help_menu->addAction(about_ktikz_act);
@@ -1144,6 +1290,7 @@ void mainwindow::load_settings() {
     const bool saved_line_numbers = settings.value("ui/show_line_numbers", show_line_numbers_).toBool();
     const QString saved_theme = settings.value("ui/theme", theme_id_).toString();
     const int saved_delay_ms = settings.value("build/auto_compile_delay_ms", auto_compile_delay_ms_).toInt();
+    const bool saved_adaptive = settings.value("build/adaptive_auto_compile", adaptive_auto_compile_).toBool();
     const QString saved_compiler = settings.value("build/compiler_command", compiler_command_).toString();
     const int saved_step_mm = settings.value("grid/step_mm", grid_snap_mm_).toInt();
     const int saved_extent_cm = settings.value("grid/extent_cm", grid_extent_cm_).toInt();
@@ -1152,10 +1299,8 @@ void mainwindow::load_settings() {
     apply_editor_font_size(saved_font_size);
     apply_line_number_visibility(saved_line_numbers);
     apply_theme(saved_theme);
-    auto_compile_delay_ms_ = qBound(100, saved_delay_ms, 3000);
-    if (auto_compile_timer_) {
-        auto_compile_timer_->setInterval(auto_compile_delay_ms_);
-    }
+    auto_compile_delay_ms_ = qBound(min_auto_compile_delay_ms, saved_delay_ms, max_auto_compile_delay_ms);
+    adaptive_auto_compile_ = saved_adaptive;
     compiler_command_ = saved_compiler.trimmed().isEmpty() ? QStringLiteral("pdflatex") : saved_compiler.trimmed();
     if (compile_service_) {
         compile_service_->set_compiler_command(compiler_command_);
@@ -1175,6 +1320,7 @@ void mainwindow::load_settings() {
     grid_snap_mm_ = normalized_step;
     grid_display_mm_ = (grid_snap_mm_ == 0) ? 10 : grid_snap_mm_;
     preview_canvas_->set_snap_mm(grid_snap_mm_);
+    preview_canvas_->set_grid(grid_display_mm_, grid_extent_cm_);
     if (grid_step_combo_) {
         const QSignalBlocker blocker(grid_step_combo_);
         const int idx = grid_step_combo_->findData(grid_snap_mm_);
@@ -1189,6 +1335,7 @@ void mainwindow::save_settings() const {
     settings.setValue("ui/show_line_numbers", show_line_numbers_);
     settings.setValue("ui/theme", theme_id_);
     settings.setValue("build/auto_compile_delay_ms", auto_compile_delay_ms_);
+    settings.setValue("build/adaptive_auto_compile", adaptive_auto_compile_);
     settings.setValue("build/compiler_command", compiler_command_);
     settings.setValue("grid/step_mm", grid_snap_mm_);
     settings.setValue("grid/extent_cm", grid_extent_cm_);
@@ -1201,6 +1348,7 @@ void mainwindow::open_settings() {
     dialog.set_show_line_numbers(show_line_numbers_);
     dialog.set_theme(theme_id_);
     dialog.set_auto_compile_delay_ms(auto_compile_delay_ms_);
+    dialog.set_adaptive_auto_compile(adaptive_auto_compile_);
     dialog.set_compiler_command(compiler_command_);
     dialog.set_grid_step_mm(grid_snap_mm_);
     dialog.set_grid_extent_cm(grid_extent_cm_);
@@ -1213,10 +1361,9 @@ void mainwindow::open_settings() {
     apply_editor_font_size(dialog.editor_font_size());
     apply_line_number_visibility(dialog.show_line_numbers());
     apply_theme(dialog.theme());
-    auto_compile_delay_ms_ = qBound(100, dialog.auto_compile_delay_ms(), 3000);
-    if (auto_compile_timer_) {
-        auto_compile_timer_->setInterval(auto_compile_delay_ms_);
-    }
+    auto_compile_delay_ms_ =
+        qBound(min_auto_compile_delay_ms, dialog.auto_compile_delay_ms(), max_auto_compile_delay_ms);
+    adaptive_auto_compile_ = dialog.adaptive_auto_compile();
     compiler_command_ = dialog.compiler_command().trimmed().isEmpty() ? QStringLiteral("pdflatex")
                                                                       : dialog.compiler_command().trimmed();
     if (compile_service_) {
@@ -1233,6 +1380,7 @@ void mainwindow::open_settings() {
     grid_snap_mm_ = qMax(0, new_step);
     grid_display_mm_ = (grid_snap_mm_ == 0) ? 10 : grid_snap_mm_;
     preview_canvas_->set_snap_mm(grid_snap_mm_);
+    preview_canvas_->set_grid(grid_display_mm_, grid_extent_cm_);
     if (grid_step_combo_) {
         const QSignalBlocker blocker(grid_step_combo_);
         const int idx = grid_step_combo_->findData(grid_snap_mm_);
@@ -1240,7 +1388,7 @@ void mainwindow::open_settings() {
     }
 
     save_settings();
-    request_compile(true);
+    request_compile();
     statusBar()->showMessage("Settings updated", 2000);
 }
 
@@ -1408,26 +1556,69 @@ void mainwindow::on_compile_service_output(const QString &text) {
     append_colored_log(output_, text, color);
 }
 
-void mainwindow::on_compile_finished(bool success, const QString &pdf_path, const QString &message) {
+void mainwindow::on_compile_finished(quint64 generation,
+                                     bool success,
+                                     const QString &pdf_path,
+                                     const QString &message,
+                                     const page_anchors &anchors) {
+    // Results are only reported in increasing generation order, so older fingerprints are done with.
+    const auto requested = requested_fingerprints_.find(generation);
+    const QString fingerprint = requested != requested_fingerprints_.end() ? requested->second : QString();
+    requested_fingerprints_.erase(requested_fingerprints_.begin(), requested_fingerprints_.upper_bound(generation));
+    if (generation <= discarded_generation_) {
+        return;
+    }
     if (message != "canceled") {
         if (!success) {
             append_colored_log(
                 output_, "[Status] Compiled with errors", theme_id_ == "dark" ? QColor("#f87171") : QColor("#dc2626"));
             statusBar()->showMessage("Compile failed", 3000);
-        } else if (!preview_canvas_->load_pdf(pdf_path)) {
-            on_compile_service_output("[Preview] Failed to load generated PDF");
-            append_colored_log(
-                output_, "[Status] Compiled with errors", theme_id_ == "dark" ? QColor("#f87171") : QColor("#dc2626"));
-            statusBar()->showMessage("Preview load failed", 3000);
         } else {
-            append_colored_log(
-                output_, "[Status] Compiled successfully", theme_id_ == "dark" ? QColor("#86efac") : QColor("#16a34a"));
-            statusBar()->showMessage("Compile successful", 2500);
+            latency_tracker_->mark(generation, static_cast<int>(latency_phase::load_pdf), latencytracker::now_us());
+            pending_shown_generation_ = generation;
+            pending_shown_fingerprint_ = fingerprint;
+            preview_canvas_->load_pdf(pdf_path, anchors, generation);
         }
     }
+}
+
+void mainwindow::on_preview_shown(quint64 generation) {
+    compile_service_->preview_shown(generation);
+    if (generation == pending_shown_generation_) {
+        shown_fingerprint_ = pending_shown_fingerprint_;
+        pending_shown_generation_ = 0;
+        pending_shown_fingerprint_.clear();
+        append_colored_log(
+            output_, "[Status] Compiled successfully", theme_id_ == "dark" ? QColor("#86efac") : QColor("#16a34a"));
+        statusBar()->showMessage("Compile successful", 2500);
+    }
+    update_grid_fallback();
+}
 
-    if (pending_compile_) {
-        pending_compile_ = false;
-        request_compile(false);
+void mainwindow::update_grid_fallback() {
+    const bool calibrated = preview_canvas_->has_calibration();
+    if (calibrated && grid_in_source_) {
+        // The canvas draws the grid again; the preview on screen keeps its copy until the next compile.
+        grid_in_source_ = false;
+        compile_service_->set_source_grid(0, 0);
+        return;
+    }
+    if (calibrated || grid_in_source_) {
+        return;
     }
+    grid_in_source_ = true;
+    compile_service_->set_source_grid(grid_display_mm_, grid_extent_cm_);
+    on_compile_service_output("[Preview] Page could not be calibrated: grid drawn by TikZ, markers unavailable");
+    statusBar()->showMessage("Preview not calibrated: grid drawn by TikZ, markers unavailable", 4000);
+    request_compile(true);
+}
+
+void mainwindow::on_preview_load_failed() {
+    shown_fingerprint_.clear();
+    pending_shown_generation_ = 0;
+    pending_shown_fingerprint_.clear();
+    on_compile_service_output("[Preview] Failed to load generated PDF");
+    append_colored_log(
+        output_, "[Status] Compiled with errors", theme_id_ == "dark" ? QColor("#f87171") : QColor("#dc2626"));
+    statusBar()->showMessage("Preview load failed", 3000);
 }
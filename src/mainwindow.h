@@ -1,12 +1,17 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <QElapsedTimer>
 #include <QMainWindow>
 #include <QString>
+#include <QThread>
+#include <map>
 #include <tuple>
 #include <vector>
 
+#include "coordinateparser.h"
 #include "model.h"
+#include "parseworker.h"
 
 class QCloseEvent;
 class QComboBox;
@@ -22,13 +27,16 @@ class QToolButton;
 class QWidget;
 
 class compileservice;
+class latencytracker;
 class pdfcanvas;
+class timingpanel;
 
 class mainwindow : public QMainWindow {
     Q_OBJECT
 
 public:
     explicit mainwindow(QWidget *parent = nullptr);
+    ~mainwindow() override;
 
 protected:
     void closeEvent(QCloseEvent *event) override;
@@ -41,15 +49,21 @@ private slots:
     void compile();
     void indent_latex();
     void on_compile_service_output(const QString &text);
-    void on_compile_finished(bool success, const QString &pdf_path, const QString &message);
-    void on_coordinate_dragged(int index, double x, double y);
-    void on_circle_radius_dragged(int index, double radius);
-    void on_ellipse_radii_dragged(int index, double rx, double ry);
-    void on_bezier_control_dragged(int index, int control_idx, double x, double y);
-    void on_rectangle_corner_dragged(int index, double x2, double y2);
+    void on_compile_finished(quint64 generation,
+                             bool success,
+                             const QString &pdf_path,
+                             const QString &message,
+                             const page_anchors &anchors);
+    void on_preview_shown(quint64 generation);
+    void on_preview_load_failed();
+    void on_coordinate_dragged(quint32 id, double x, double y);
+    void on_circle_radius_dragged(quint32 id, double radius);
+    void on_ellipse_radii_dragged(quint32 id, double rx, double ry);
+    void on_bezier_control_dragged(quint32 id, int control_idx, double x, double y);
+    void on_rectangle_corner_dragged(quint32 id, double x2, double y2);
     void on_grid_step_changed(int value);
     void on_grid_extent_changed(int value);
-    void on_canvas_selection_changed(const QString &type, int index, int subindex);
+    void on_canvas_selection_changed(const QString &type, int row, int subindex);
     void apply_selected_geometry_changes();
     void apply_selected_style_changes();
     void delete_selected_object();
@@ -62,6 +76,8 @@ private slots:
     void start_add_node_mode();
     void on_canvas_add_point(double x, double y);
     void on_document_modified_changed(bool modified);
+    void on_editor_contents_change(int position, int removed, int added);
+    void on_source_parsed(quint64 revision, const document_index_ptr &index);
     void on_editor_text_changed();
     void on_auto_compile_timeout();
     void open_settings();
@@ -71,8 +87,16 @@ private:
     void create_menu_and_toolbar();
     void update_window_title();
     bool maybe_save_before_action(const QString &title, const QString &text);
-    void request_compile(bool cancel_running);
+    void request_compile(bool force = false);
+    void update_grid_fallback();
+    void request_background_parse();
+    void update_canvas_primitives();
+    // The current table if id is a primitive of that kind, with its row.
+    const primitive_table *drag_target(quint32 id, primitive_kind kind, int &row);
+    void apply_drag_segments(const std::vector<std::tuple<int, int, QString>> &segments);
+    int auto_compile_delay() const;
     void replace_editor_text_preserve_undo(const QString &text);
+    void replace_editor_range(int start, int end, const QString &text);
     void apply_editor_font_size(int size);
     void apply_editor_font_family(const QString &family);
     void apply_line_number_visibility(bool visible);
@@ -85,8 +109,9 @@ private:
     void ensure_minimal_document_loaded();
     void set_add_object_mode(const QString &mode);
     bool replace_segments(QString &text, const std::vector<std::tuple<int, int, QString>> &segments);
+    int selected_row() const;
     int selected_anchor_position() const;
-    bool selected_command_span(int &start_out, int &end_out) const;
+    const coordinateparser::statement_ref *selected_statement() const;
 
     QPlainTextEdit *editor_ = nullptr;
     QWidget *left_panel_ = nullptr;
@@ -123,27 +148,46 @@ private:
     QPushButton *props_delete_btn_ = nullptr;
     compileservice *compile_service_ = nullptr;
     QTimer *auto_compile_timer_ = nullptr;
+    latencytracker *latency_tracker_ = nullptr;
+    timingpanel *timing_panel_ = nullptr;
 
-    std::vector<coord_ref> coordinate_refs_;
-    std::vector<circle_ref> circle_refs_;
-    std::vector<ellipse_ref> ellipse_refs_;
-    std::vector<bezier_ref> bezier_refs_;
-    std::vector<rectangle_ref> rectangle_refs_;
+    QThread parse_thread_;
+    parseworker *parse_worker_ = nullptr;
+    coordinateparser::document_index source_index_;
+    // Edits seen by the editor and the edit the index describes. While they differ a parse is
+    // running, and offsets from the index must not be written back to the source.
+    quint64 source_revision_ = 0;
+    quint64 index_revision_ = 0;
+    bool parse_in_flight_ = false;
+    // What the canvas shows; its rows map canvas selections to ids.
+    primitive_snapshot_ptr canvas_primitives_;
     int grid_snap_mm_ = 10;
     int grid_display_mm_ = 10;
     int grid_extent_cm_ = 20;
+    // Set while the preview cannot be calibrated and TikZ draws the grid in place of the canvas.
+    bool grid_in_source_ = false;
     QString editor_font_family_ = QStringLiteral("Monospace");
     int editor_font_size_ = 12;
     bool show_line_numbers_ = true;
     int auto_compile_delay_ms_ = 450;
+    bool adaptive_auto_compile_ = false;
+    double typing_interval_ms_ = 0.0;
+    QElapsedTimer last_edit_timer_;
+    quint64 requested_generation_ = 0;
+    quint64 discarded_generation_ = 0;
+    std::map<quint64, QString> requested_fingerprints_;
+    QString shown_fingerprint_;
+    // The preview being loaded off-screen; it only counts as shown once the canvas swaps it in.
+    quint64 pending_shown_generation_ = 0;
+    QString pending_shown_fingerprint_;
     QString compiler_command_ = QStringLiteral("pdflatex");
     QString theme_id_ = QStringLiteral("system");
     bool suppress_auto_compile_ = false;
-    bool pending_compile_ = false;
     bool suppress_properties_apply_ = false;
     QString add_object_mode_;
     QString selected_type_;
-    int selected_index_ = -1;
+    // Id of the selected primitive, which follows it through edits; 0 when nothing is selected.
+    quint32 selected_id_ = 0;
     int selected_subindex_ = -1;
     QString current_file_path_;
 };
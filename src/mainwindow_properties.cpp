@@ -6,9 +6,9 @@
 #include <QMessageBox>
 #include <QPlainTextEdit>
 #include <QPushButton>
-#include <QRegularExpression>
 #include <QSignalBlocker>
 #include <QStatusBar>
+#include <QTextDocument>
 
 #include <algorithm>
 #include <tuple>
@@ -18,169 +18,93 @@
 #include "coordinateparser.h"
 #include "pdfcanvas.h"
 
-void mainwindow::on_coordinate_dragged(int index, double x, double y) {
-    if (!editor_ || !compile_service_) {
-        return;
-    }
-    if (compile_service_->is_busy()) {
-        return;
-    }
-    if (index < 0 || index >= static_cast<int>(coordinate_refs_.size())) {
-        return;
-    }
+namespace {
 
-    const coord_ref ref = coordinate_refs_[index];
-    QString text = editor_->toPlainText();
-    if (ref.end <= ref.start || ref.end > text.size()) {
-        return;
-    }
-
-    const QString replacement = "(" + coordinateparser::format_number(x) + "," + coordinateparser::format_number(y) + ")";
-    text.replace(ref.start, ref.end - ref.start, replacement);
-    replace_editor_text_preserve_undo(text);
-    compile();
+// The source range of one value of a row, with the text to put there.
+std::tuple<int, int, QString> slot_segment(const primitive_table &table, int row, int slot, double value) {
+    return {table.span_start[slot][row], table.span_end[slot][row], coordinateparser::format_number(value)};
 }
 
-void mainwindow::on_circle_radius_dragged(int index, double radius) {
+} // namespace
+
+const primitive_table *mainwindow::drag_target(quint32 id, primitive_kind kind, int &row) {
     if (!editor_ || !compile_service_) {
-        return;
-    }
-    if (compile_service_->is_busy()) {
-        return;
-    }
-    if (index < 0 || index >= static_cast<int>(circle_refs_.size())) {
-        return;
-    }
+        return nullptr;
+    }
+    // Ids follow their primitive across edits, so the drag holds against the index of the current
+    // text, whichever snapshot the canvas showed.
+    if (index_revision_ != source_revision_) {
+        statusBar()->showMessage("Source is still being parsed, drag ignored", 2000);
+        return nullptr;
+    }
+    const primitive_table &table = source_index_.primitives();
+    row = source_index_.row_of(id);
+    if (row < 0 || table.kind[row] != kind) {
+        // The dragged primitive was edited away; show where the markers are now instead.
+        update_canvas_primitives();
+        statusBar()->showMessage("Source changed, markers refreshed", 2000);
+        return nullptr;
+    }
+    return &table;
+}
 
-    const circle_ref ref = circle_refs_[index];
+void mainwindow::apply_drag_segments(const std::vector<std::tuple<int, int, QString>> &segments) {
     QString text = editor_->toPlainText();
-    if (ref.radius_end <= ref.radius_start || ref.radius_end > text.size()) {
+    if (!replace_segments(text, segments)) {
         return;
     }
-
-    const QString replacement = coordinateparser::format_number(radius);
-    text.replace(ref.radius_start, ref.radius_end - ref.radius_start, replacement);
     replace_editor_text_preserve_undo(text);
     compile();
 }
 
-void mainwindow::on_ellipse_radii_dragged(int index, double rx, double ry) {
-    if (!editor_ || !compile_service_) {
-        return;
-    }
-    if (compile_service_->is_busy()) {
-        return;
-    }
-    if (index < 0 || index >= static_cast<int>(ellipse_refs_.size())) {
-        return;
-    }
-
-    const ellipse_ref ref = ellipse_refs_[index];
-    QString text = editor_->toPlainText();
-    if (ref.rx_end <= ref.rx_start || ref.ry_end <= ref.ry_start) {
+void mainwindow::on_coordinate_dragged(quint32 id, double x, double y) {
+    int row = -1;
+    const primitive_table *table = drag_target(id, primitive_kind::coordinate, row);
+    if (!table) {
         return;
     }
-    if (ref.rx_end > text.size() || ref.ry_end > text.size()) {
-        return;
-    }
-
-    const QString rx_str = coordinateparser::format_number(rx);
-    const QString ry_str = coordinateparser::format_number(ry);
-
-    // Replace from right to left so offsets remain valid.
-    if (ref.rx_start > ref.ry_start) {
-        text.replace(ref.rx_start, ref.rx_end - ref.rx_start, rx_str);
-        text.replace(ref.ry_start, ref.ry_end - ref.ry_start, ry_str);
-    } else {
-        text.replace(ref.ry_start, ref.ry_end - ref.ry_start, ry_str);
-        text.replace(ref.rx_start, ref.rx_end - ref.rx_start, rx_str);
-    }
-
-    replace_editor_text_preserve_undo(text);
-    compile();
+    const QString replacement = "(" + coordinateparser::format_number(x) + "," + coordinateparser::format_number(y) + ")";
+    apply_drag_segments({{table->start[row], table->end[row], replacement}});
 }
 
-void mainwindow::on_bezier_control_dragged(int index, int control_idx, double x, double y) {
-    if (!editor_ || !compile_service_) {
-        return;
-    }
-    if (compile_service_->is_busy()) {
-        return;
-    }
-    if (index < 0 || index >= static_cast<int>(bezier_refs_.size())) {
+void mainwindow::on_circle_radius_dragged(quint32 id, double radius) {
+    int row = -1;
+    const primitive_table *table = drag_target(id, primitive_kind::circle, row);
+    if (!table) {
         return;
     }
+    apply_drag_segments({slot_segment(*table, row, circle_slot::r, radius)});
+}
 
-    const bezier_ref ref = bezier_refs_[index];
-    QString text = editor_->toPlainText();
-    int x_start = 0;
-    int x_end = 0;
-    int y_start = 0;
-    int y_end = 0;
-    if (control_idx == 1) {
-        x_start = ref.x1_start;
-        x_end = ref.x1_end;
-        y_start = ref.y1_start;
-        y_end = ref.y1_end;
-    } else if (control_idx == 2) {
-        x_start = ref.x2_start;
-        x_end = ref.x2_end;
-        y_start = ref.y2_start;
-        y_end = ref.y2_end;
-    } else {
-        return;
-    }
-    if (x_end <= x_start || y_end <= y_start || x_end > text.size() || y_end > text.size()) {
+void mainwindow::on_ellipse_radii_dragged(quint32 id, double rx, double ry) {
+    int row = -1;
+    const primitive_table *table = drag_target(id, primitive_kind::ellipse, row);
+    if (!table) {
         return;
     }
-
-    const QString x_str = coordinateparser::format_number(x);
-    const QString y_str = coordinateparser::format_number(y);
-    if (x_start > y_start) {
-        text.replace(x_start, x_end - x_start, x_str);
-        text.replace(y_start, y_end - y_start, y_str);
-    } else {
-        text.replace(y_start, y_end - y_start, y_str);
-        text.replace(x_start, x_end - x_start, x_str);
-    }
-    replace_editor_text_preserve_undo(text);
-    compile();
+    apply_drag_segments(
+        {slot_segment(*table, row, ellipse_slot::rx, rx), slot_segment(*table, row, ellipse_slot::ry, ry)});
 }
 
-void mainwindow::on_rectangle_corner_dragged(int index, double x2, double y2) {
-    if (!editor_ || !compile_service_) {
-        return;
-    }
-    if (compile_service_->is_busy()) {
-        return;
-    }
-    if (index < 0 || index >= static_cast<int>(rectangle_refs_.size())) {
+void mainwindow::on_bezier_control_dragged(quint32 id, int control_idx, double x, double y) {
+    int row = -1;
+    const primitive_table *table = drag_target(id, primitive_kind::bezier, row);
+    if (!table || (control_idx != 1 && control_idx != 2)) {
         return;
     }
+    const int x_slot = control_idx == 1 ? bezier_slot::x1 : bezier_slot::x2;
+    const int y_slot = control_idx == 1 ? bezier_slot::y1 : bezier_slot::y2;
+    apply_drag_segments({slot_segment(*table, row, x_slot, x), slot_segment(*table, row, y_slot, y)});
+}
 
-    const rectangle_ref ref = rectangle_refs_[index];
-    QString text = editor_->toPlainText();
-    if (ref.x2_end <= ref.x2_start || ref.y2_end <= ref.y2_start) {
+void mainwindow::on_rectangle_corner_dragged(quint32 id, double x2, double y2) {
+    int row = -1;
+    const primitive_table *table = drag_target(id, primitive_kind::rectangle, row);
+    if (!table) {
         return;
     }
-    if (ref.x2_end > text.size() || ref.y2_end > text.size()) {
-        return;
-    }
-
-    const QString x2_str = coordinateparser::format_number(x2);
-    const QString y2_str = coordinateparser::format_number(y2);
-
-    // Replace from right to left so offsets remain valid.
-    if (ref.x2_start > ref.y2_start) {
-        text.replace(ref.x2_start, ref.x2_end - ref.x2_start, x2_str);
-        text.replace(ref.y2_start, ref.y2_end - ref.y2_start, y2_str);
-    } else {
-        text.replace(ref.y2_start, ref.y2_end - ref.y2_start, y2_str);
-        text.replace(ref.x2_start, ref.x2_end - ref.x2_start, x2_str);
-    }
-
-    replace_editor_text_preserve_undo(text);
-    compile();
+    apply_drag_segments(
+        {slot_segment(*table, row, rectangle_slot::x2, x2), slot_segment(*table, row, rectangle_slot::y2, y2)});
 }
 
 void mainwindow::on_grid_step_changed(int) {
@@ -188,25 +112,34 @@ void mainwindow::on_grid_step_changed(int) {
     grid_snap_mm_ = qMax(0, selected);
     grid_display_mm_ = (grid_snap_mm_ == 0) ? 10 : grid_snap_mm_;
     preview_canvas_->set_snap_mm(grid_snap_mm_);
+    preview_canvas_->set_grid(grid_display_mm_, grid_extent_cm_);
+    if (grid_in_source_) {
+        compile_service_->set_source_grid(grid_display_mm_, grid_extent_cm_);
+        request_compile(true);
+    }
 
     statusBar()->showMessage(
         grid_snap_mm_ == 0
             ? "Grid: 10 mm, Snap: free hand"
             : ("Grid/Snap step: " + QString::number(grid_snap_mm_) + " mm"),
         1500);
-
-    request_compile(true);
 }
 
 void mainwindow::on_grid_extent_changed(int value) {
     grid_extent_cm_ = qBound(20, value, 100);
+    preview_canvas_->set_grid(grid_display_mm_, grid_extent_cm_);
+    if (grid_in_source_) {
+        compile_service_->set_source_grid(grid_display_mm_, grid_extent_cm_);
+        request_compile(true);
+    }
     statusBar()->showMessage("Grid extent: " + QString::number(grid_extent_cm_) + " cm", 1500);
-    request_compile(true);
 }
 
-void mainwindow::on_canvas_selection_changed(const QString &type, int index, int subindex) {
-    selected_type_ = type;
-    selected_index_ = index;
+void mainwindow::on_canvas_selection_changed(const QString &type, int row, int subindex) {
+    // The canvas shows canvas_primitives_; its rows are not those of source_index_ after an edit.
+    const bool valid = !type.isEmpty() && canvas_primitives_ && row >= 0 && row < canvas_primitives_->size();
+    selected_type_ = valid ? type : QString();
+    selected_id_ = valid ? canvas_primitives_->id[row] : 0;
     selected_subindex_ = subindex;
     update_properties_panel();
 }
@@ -223,50 +156,24 @@ bool mainwindow::replace_segments(QString &text, const std::vector<std::tuple<in
     return true;
 }
 
+int mainwindow::selected_row() const {
+    return selected_id_ == 0 ? -1 : source_index_.row_of(selected_id_);
+}
+
 int mainwindow::selected_anchor_position() const {
-    if (selected_index_ < 0) {
+    const int row = selected_row();
+    if (row < 0 || index_revision_ != source_revision_) {
         return -1;
     }
-    if (selected_type_ == "coordinate" && selected_index_ < static_cast<int>(coordinate_refs_.size())) {
-        return coordinate_refs_[selected_index_].start;
-    }
-    if (selected_type_ == "circle" && selected_index_ < static_cast<int>(circle_refs_.size())) {
-        return circle_refs_[selected_index_].radius_start;
-    }
-    if (selected_type_ == "ellipse" && selected_index_ < static_cast<int>(ellipse_refs_.size())) {
-        return ellipse_refs_[selected_index_].rx_start;
-    }
-    if (selected_type_ == "rectangle" && selected_index_ < static_cast<int>(rectangle_refs_.size())) {
-        return rectangle_refs_[selected_index_].x2_start;
-    }
-    if (selected_type_ == "bezier" && selected_index_ < static_cast<int>(bezier_refs_.size())) {
-        return bezier_refs_[selected_index_].x1_start;
-    }
-    return -1;
+    return source_index_.primitives().start[row];
 }
 
-bool mainwindow::selected_command_span(int &start_out, int &end_out) const {
-    if (!editor_) {
-        return false;
-    }
+const coordinateparser::statement_ref *mainwindow::selected_statement() const {
     const int anchor = selected_anchor_position();
     if (anchor < 0) {
-        return false;
-    }
-    const QString text = editor_->toPlainText();
-    static const QRegularExpression drawable_cmd(R"(\\(?:draw|node)(?:\s*\[[^\]]*\])?[\s\S]*?;)");
-    QRegularExpressionMatchIterator it = drawable_cmd.globalMatch(text);
-    while (it.hasNext()) {
-        const QRegularExpressionMatch m = it.next();
-        const int s = m.capturedStart(0);
-        const int e = s + m.capturedLength(0);
-        if (anchor >= s && anchor < e) {
-            start_out = s;
-            end_out = e;
-            return true;
-        }
+        return nullptr;
     }
-    return false;
+    return source_index_.statement_at(anchor);
 }
 
 void mainwindow::clear_properties_panel(const QString &message) {
@@ -336,7 +243,7 @@ void mainwindow::update_properties_panel() {
     if (!props_selection_value_) {
         return;
     }
-    if (selected_type_.isEmpty() || selected_index_ < 0) {
+    if (selected_type_.isEmpty() || selected_id_ == 0) {
         clear_properties_panel();
         return;
     }
@@ -383,20 +290,10 @@ void mainwindow::update_properties_panel() {
         props_delete_btn_->setEnabled(true);
     }
 
-    int cmd_start = 0;
-    int cmd_end = 0;
-    if (selected_command_span(cmd_start, cmd_end) && editor_) {
-        const QString cmd = editor_->toPlainText().mid(cmd_start, cmd_end - cmd_start);
-        static const QRegularExpression draw_head(R"(^(\s*\\(?:draw|node))\s*(\[[^\]]*\])?)");
-        const QRegularExpressionMatch m = draw_head.match(cmd);
-        if (m.hasMatch() && m.capturedStart(2) >= 0) {
-            QString opts_text = m.captured(2);
-            opts_text.remove(0, 1);
-            opts_text.chop(1);
-            QStringList opts = opts_text.split(',', Qt::SkipEmptyParts);
-            for (QString &v : opts) {
-                v = v.trimmed();
-            }
+    const coordinateparser::statement_ref *statement = selected_statement();
+    if (statement) {
+        if (statement->options_start >= 0) {
+            const QStringList &opts = statement->options;
 
             auto find_prefix_value = [&opts](const QString &prefix) -> QString {
                 for (const QString &v : opts) {
@@ -433,7 +330,7 @@ void mainwindow::update_properties_panel() {
                 combo->setCurrentIndex(idx);
             };
 
-            const QString command_name = m.captured(1).contains("\\node") ? QStringLiteral("node") : QStringLiteral("draw");
+            const QString command_name = statement->node ? QStringLiteral("node") : QStringLiteral("draw");
             const QString explicit_draw = (command_name == "node") ? find_prefix_value("text=") : find_prefix_value("draw=");
             QString draw_color = explicit_draw;
             if (draw_color.isEmpty()) {
@@ -547,160 +444,104 @@ void mainwindow::update_properties_panel() {
         }
     }
 
-    if (selected_type_ == "coordinate") {
-        if (selected_index_ >= static_cast<int>(coordinate_refs_.size())) {
-            clear_properties_panel();
-            return;
-        }
-        const coord_ref &c = coordinate_refs_[selected_index_];
-        props_selection_value_->setText("Coordinate #" + QString::number(selected_index_ + 1));
-        show_spin(props_label_1_, props_value_1_, "x", c.x);
-        show_spin(props_label_2_, props_value_2_, "y", c.y);
-        suppress_properties_apply_ = false;
-        return;
-    }
-
-    if (selected_type_ == "circle") {
-        if (selected_index_ >= static_cast<int>(circle_refs_.size())) {
-            clear_properties_panel();
-            return;
-        }
-        const circle_ref &c = circle_refs_[selected_index_];
-        props_selection_value_->setText("Circle #" + QString::number(selected_index_ + 1));
-        show_spin(props_label_1_, props_value_1_, "center x", c.cx);
-        show_spin(props_label_2_, props_value_2_, "center y", c.cy);
-        show_spin(props_label_3_, props_value_3_, "radius", c.r);
-        suppress_properties_apply_ = false;
-        return;
-    }
-
-    if (selected_type_ == "ellipse") {
-        if (selected_index_ >= static_cast<int>(ellipse_refs_.size())) {
-            clear_properties_panel();
-            return;
-        }
-        const ellipse_ref &e = ellipse_refs_[selected_index_];
-        props_selection_value_->setText("Ellipse #" + QString::number(selected_index_ + 1));
-        show_spin(props_label_1_, props_value_1_, "center x", e.cx);
-        show_spin(props_label_2_, props_value_2_, "center y", e.cy);
-        show_spin(props_label_3_, props_value_3_, "rx", e.rx);
-        show_spin(props_label_4_, props_value_4_, "ry", e.ry);
-        suppress_properties_apply_ = false;
-        return;
-    }
-
-    if (selected_type_ == "rectangle") {
-        if (selected_index_ >= static_cast<int>(rectangle_refs_.size())) {
-            clear_properties_panel();
-            return;
-        }
-        const rectangle_ref &r = rectangle_refs_[selected_index_];
-        props_selection_value_->setText("Rectangle #" + QString::number(selected_index_ + 1));
-        show_spin(props_label_1_, props_value_1_, "x1", r.x1);
-        show_spin(props_label_2_, props_value_2_, "y1", r.y1);
-        show_spin(props_label_3_, props_value_3_, "x2", r.x2);
-        show_spin(props_label_4_, props_value_4_, "y2", r.y2);
+    const primitive_table &table = source_index_.primitives();
+    const int row = selected_row();
+    if (row < 0) {
+        clear_properties_panel();
         suppress_properties_apply_ = false;
         return;
     }
-
-    if (selected_type_ == "bezier") {
-        if (selected_index_ >= static_cast<int>(bezier_refs_.size())) {
-            clear_properties_panel();
-            return;
-        }
-        const bezier_ref &b = bezier_refs_[selected_index_];
+    const auto value = [&table, row](int slot) { return table.value[slot][row]; };
+    const QString number = " #" + QString::number(source_index_.kind_ordinal(row));
+    const primitive_kind kind = table.kind[row];
+    if (kind == primitive_kind::coordinate) {
+        props_selection_value_->setText("Coordinate" + number);
+        show_spin(props_label_1_, props_value_1_, "x", value(coordinate_slot::x));
+        show_spin(props_label_2_, props_value_2_, "y", value(coordinate_slot::y));
+    } else if (kind == primitive_kind::circle) {
+        props_selection_value_->setText("Circle" + number);
+        show_spin(props_label_1_, props_value_1_, "center x", value(circle_slot::cx));
+        show_spin(props_label_2_, props_value_2_, "center y", value(circle_slot::cy));
+        show_spin(props_label_3_, props_value_3_, "radius", value(circle_slot::r));
+    } else if (kind == primitive_kind::ellipse) {
+        props_selection_value_->setText("Ellipse" + number);
+        show_spin(props_label_1_, props_value_1_, "center x", value(ellipse_slot::cx));
+        show_spin(props_label_2_, props_value_2_, "center y", value(ellipse_slot::cy));
+        show_spin(props_label_3_, props_value_3_, "rx", value(ellipse_slot::rx));
+        show_spin(props_label_4_, props_value_4_, "ry", value(ellipse_slot::ry));
+    } else if (kind == primitive_kind::rectangle) {
+        props_selection_value_->setText("Rectangle" + number);
+        show_spin(props_label_1_, props_value_1_, "x1", value(rectangle_slot::x1));
+        show_spin(props_label_2_, props_value_2_, "y1", value(rectangle_slot::y1));
+        show_spin(props_label_3_, props_value_3_, "x2", value(rectangle_slot::x2));
+        show_spin(props_label_4_, props_value_4_, "y2", value(rectangle_slot::y2));
+    } else {
         props_selection_value_->setText(
-            "Bezier #" + QString::number(selected_index_ + 1) +
+            "Bezier" + number +
             (selected_subindex_ == 1 ? " (control 1)" : (selected_subindex_ == 2 ? " (control 2)" : "")));
-        show_spin(props_label_1_, props_value_1_, "c1 x", b.x1);
-        show_spin(props_label_2_, props_value_2_, "c1 y", b.y1);
-        show_spin(props_label_3_, props_value_3_, "c2 x", b.x2);
-        show_spin(props_label_4_, props_value_4_, "c2 y", b.y2);
-        suppress_properties_apply_ = false;
-        return;
+        show_spin(props_label_1_, props_value_1_, "c1 x", value(bezier_slot::x1));
+        show_spin(props_label_2_, props_value_2_, "c1 y", value(bezier_slot::y1));
+        show_spin(props_label_3_, props_value_3_, "c2 x", value(bezier_slot::x2));
+        show_spin(props_label_4_, props_value_4_, "c2 y", value(bezier_slot::y2));
     }
-
-    clear_properties_panel();
     suppress_properties_apply_ = false;
 }
 
 void mainwindow::apply_selected_geometry_changes() {
-    if (suppress_properties_apply_ || !editor_ || selected_type_.isEmpty() || selected_index_ < 0) {
+    const int row = selected_row();
+    if (suppress_properties_apply_ || !editor_ || row < 0 || index_revision_ != source_revision_) {
         return;
     }
 
+    const primitive_table &table = source_index_.primitives();
     QString text = editor_->toPlainText();
     std::vector<std::tuple<int, int, QString>> segments;
-    auto num = [](QDoubleSpinBox *s) { return coordinateparser::format_number(s ? s->value() : 0.0); };
-
-    if (selected_type_ == "coordinate" && selected_index_ < static_cast<int>(coordinate_refs_.size())) {
-        const coord_ref &r = coordinate_refs_[selected_index_];
-        segments.push_back({r.x_start, r.x_end, num(props_value_1_)});
-        segments.push_back({r.y_start, r.y_end, num(props_value_2_)});
-    } else if (selected_type_ == "circle" && selected_index_ < static_cast<int>(circle_refs_.size())) {
-        const circle_ref &r = circle_refs_[selected_index_];
-        segments.push_back({r.cx_start, r.cx_end, num(props_value_1_)});
-        segments.push_back({r.cy_start, r.cy_end, num(props_value_2_)});
-        segments.push_back({r.radius_start, r.radius_end, num(props_value_3_)});
-    } else if (selected_type_ == "ellipse" && selected_index_ < static_cast<int>(ellipse_refs_.size())) {
-        const ellipse_ref &r = ellipse_refs_[selected_index_];
-        segments.push_back({r.cx_start, r.cx_end, num(props_value_1_)});
-        segments.push_back({r.cy_start, r.cy_end, num(props_value_2_)});
-        segments.push_back({r.rx_start, r.rx_end, num(props_value_3_)});
-        segments.push_back({r.ry_start, r.ry_end, num(props_value_4_)});
-    } else if (selected_type_ == "rectangle" && selected_index_ < static_cast<int>(rectangle_refs_.size())) {
-        const rectangle_ref &r = rectangle_refs_[selected_index_];
-        segments.push_back({r.x1_start, r.x1_end, num(props_value_1_)});
-        segments.push_back({r.y1_start, r.y1_end, num(props_value_2_)});
-        segments.push_back({r.x2_start, r.x2_end, num(props_value_3_)});
-        segments.push_back({r.y2_start, r.y2_end, num(props_value_4_)});
-    } else if (selected_type_ == "bezier" && selected_index_ < static_cast<int>(bezier_refs_.size())) {
-        const bezier_ref &r = bezier_refs_[selected_index_];
-        segments.push_back({r.x1_start, r.x1_end, num(props_value_1_)});
-        segments.push_back({r.y1_start, r.y1_end, num(props_value_2_)});
-        segments.push_back({r.x2_start, r.x2_end, num(props_value_3_)});
-        segments.push_back({r.y2_start, r.y2_end, num(props_value_4_)});
+    const auto edit = [&](int slot, QDoubleSpinBox *s) {
+        segments.push_back(slot_segment(table, row, slot, s ? s->value() : 0.0));
+    };
+
+    const primitive_kind kind = table.kind[row];
+    if (kind == primitive_kind::coordinate) {
+        edit(coordinate_slot::x, props_value_1_);
+        edit(coordinate_slot::y, props_value_2_);
+    } else if (kind == primitive_kind::circle) {
+        edit(circle_slot::cx, props_value_1_);
+        edit(circle_slot::cy, props_value_2_);
+        edit(circle_slot::r, props_value_3_);
+    } else if (kind == primitive_kind::ellipse) {
+        edit(ellipse_slot::cx, props_value_1_);
+        edit(ellipse_slot::cy, props_value_2_);
+        edit(ellipse_slot::rx, props_value_3_);
+        edit(ellipse_slot::ry, props_value_4_);
+    } else if (kind == primitive_kind::rectangle) {
+        edit(rectangle_slot::x1, props_value_1_);
+        edit(rectangle_slot::y1, props_value_2_);
+        edit(rectangle_slot::x2, props_value_3_);
+        edit(rectangle_slot::y2, props_value_4_);
     } else {
-        return;
+        edit(bezier_slot::x1, props_value_1_);
+        edit(bezier_slot::y1, props_value_2_);
+        edit(bezier_slot::x2, props_value_3_);
+        edit(bezier_slot::y2, props_value_4_);
     }
 
     if (!replace_segments(text, segments)) {
         return;
     }
     replace_editor_text_preserve_undo(text);
-    request_compile(true);
+    request_compile();
 }
 
 void mainwindow::apply_selected_style_changes() {
-    if (suppress_properties_apply_ || !editor_ || selected_type_.isEmpty() || selected_index_ < 0) {
-        return;
-    }
-    int cmd_start = 0;
-    int cmd_end = 0;
-    if (!selected_command_span(cmd_start, cmd_end)) {
+    if (suppress_properties_apply_ || !editor_ || selected_type_.isEmpty() || selected_id_ == 0) {
         return;
     }
-
-    QString text = editor_->toPlainText();
-    QString cmd = text.mid(cmd_start, cmd_end - cmd_start);
-    static const QRegularExpression draw_head(R"(^(\s*\\(?:draw|node))\s*(\[[^\]]*\])?)");
-    const QRegularExpressionMatch m = draw_head.match(cmd);
-    if (!m.hasMatch()) {
+    const coordinateparser::statement_ref *statement = selected_statement();
+    if (!statement) {
         return;
     }
-    const bool is_node_command = m.captured(1).contains("\\node");
-
-    QStringList opts;
-    if (m.capturedStart(2) >= 0) {
-        QString o = m.captured(2);
-        o.remove(0, 1);
-        o.chop(1);
-        opts = o.split(',', Qt::SkipEmptyParts);
-        for (QString &v : opts) {
-            v = v.trimmed();
-        }
-    }
+    const bool is_node_command = statement->node;
+    QStringList opts = statement->options;
 
     auto remove_tokens = [&opts](const QStringList &to_remove) {
         opts.erase(
@@ -785,25 +626,25 @@ void mainwindow::apply_selected_style_changes() {
     remove_prefix("fill opacity=");
     opts.push_back("fill opacity=" + coordinateparser::format_number(fill_opacity));
 
-    const QString new_head = m.captured(1) + (opts.isEmpty() ? QString() : "[" + opts.join(",") + "]");
-    cmd.replace(0, m.capturedLength(0), new_head);
-    text.replace(cmd_start, cmd_end - cmd_start, cmd);
-    replace_editor_text_preserve_undo(text);
-    request_compile(true);
+    const QString command_name = is_node_command ? QStringLiteral("\\node") : QStringLiteral("\\draw");
+    const QString new_head = command_name + (opts.isEmpty() ? QString() : "[" + opts.join(",") + "]");
+    replace_editor_range(statement->start, statement->head_end, new_head);
+    request_compile();
 }
 
 
 void mainwindow::delete_selected_object() {
-    if (!editor_ || selected_type_.isEmpty() || selected_index_ < 0) {
+    if (!editor_ || selected_type_.isEmpty() || selected_id_ == 0) {
         return;
     }
 
-    int cmd_start = 0;
-    int cmd_end = 0;
-    if (!selected_command_span(cmd_start, cmd_end)) {
+    const coordinateparser::statement_ref *statement = selected_statement();
+    if (!statement) {
         statusBar()->showMessage("No object command found to delete", 2500);
         return;
     }
+    const int cmd_start = statement->start;
+    const int cmd_end = statement->end;
 
     QMessageBox box(this);
     box.setWindowTitle("Delete object");
@@ -818,27 +659,29 @@ void mainwindow::delete_selected_object() {
         return;
     }
 
-    QString text = editor_->toPlainText();
-    if (cmd_start < 0 || cmd_end <= cmd_start || cmd_end > text.size()) {
+    const QTextDocument *document = editor_->document();
+    const int length = document->characterCount() - 1;
+    if (cmd_start < 0 || cmd_end <= cmd_start || cmd_end > length) {
         return;
     }
 
+    // The document stores line breaks as paragraph separators.
     int erase_start = cmd_start;
     int erase_end = cmd_end;
-    if (erase_end < text.size() && text[erase_end] == '\n') {
+    if (erase_end < length && document->characterAt(erase_end) == QChar::ParagraphSeparator) {
         ++erase_end;
     } else {
-        while (erase_start > 0 && text[erase_start - 1] != '\n' && text[erase_start - 1].isSpace()) {
+        while (erase_start > 0 && document->characterAt(erase_start - 1) != QChar::ParagraphSeparator &&
+               document->characterAt(erase_start - 1).isSpace()) {
             --erase_start;
         }
     }
 
-    text.remove(erase_start, erase_end - erase_start);
-    replace_editor_text_preserve_undo(text);
+    replace_editor_range(erase_start, erase_end, QString());
     selected_type_.clear();
-    selected_index_ = -1;
+    selected_id_ = 0;
     selected_subindex_ = -1;
     clear_properties_panel();
-    request_compile(true);
+    request_compile();
     statusBar()->showMessage("Selected object deleted", 2000);
 }
@@ -1,116 +1,64 @@
 #ifndef MODEL_H
 #define MODEL_H
 
-struct coord_pair {
-    double x = 0.0;
-    double y = 0.0;
-};
+#include <QMetaType>
+#include <array>
+#include <memory>
+#include <vector>
 
-struct coord_ref {
-    int start = 0;
-    int end = 0;
-    int x_start = 0;
-    int x_end = 0;
-    int y_start = 0;
-    int y_end = 0;
-    double x = 0.0;
-    double y = 0.0;
-};
+enum class primitive_kind : quint8 { coordinate, circle, ellipse, bezier, rectangle };
 
-struct circle_pair {
-    double cx = 0.0;
-    double cy = 0.0;
-    double r = 0.0;
+// Value slots of each kind. A bezier segment that continues the previous one has no spans for x0/y0.
+struct coordinate_slot {
+    enum : int { x, y };
 };
-
-struct circle_ref {
-    int cx_start = 0;
-    int cx_end = 0;
-    int cy_start = 0;
-    int cy_end = 0;
-    int radius_start = 0;
-    int radius_end = 0;
-    double cx = 0.0;
-    double cy = 0.0;
-    double r = 0.0;
+struct circle_slot {
+    enum : int { cx, cy, r };
 };
-
-struct rectangle_pair {
-    double x1 = 0.0;
-    double y1 = 0.0;
-    double x2 = 0.0;
-    double y2 = 0.0;
+struct ellipse_slot {
+    enum : int { cx, cy, rx, ry };
 };
-
-struct rectangle_ref {
-    int x1_start = 0;
-    int x1_end = 0;
-    int y1_start = 0;
-    int y1_end = 0;
-    int x2_start = 0;
-    int x2_end = 0;
-    int y2_start = 0;
-    int y2_end = 0;
-    double x1 = 0.0;
-    double y1 = 0.0;
-    double x2 = 0.0;
-    double y2 = 0.0;
+struct rectangle_slot {
+    enum : int { x1, y1, x2, y2 };
 };
-
-struct ellipse_pair {
-    double cx = 0.0;
-    double cy = 0.0;
-    double rx = 0.0;
-    double ry = 0.0;
+struct bezier_slot {
+    enum : int { x0, y0, x1, y1, x2, y2, x3, y3 };
 };
 
-struct ellipse_ref {
-    int cx_start = 0;
-    int cx_end = 0;
-    int cy_start = 0;
-    int cy_end = 0;
-    int rx_start = 0;
-    int rx_end = 0;
-    int ry_start = 0;
-    int ry_end = 0;
-    double cx = 0.0;
-    double cy = 0.0;
-    double rx = 0.0;
-    double ry = 0.0;
-};
+// Every primitive of one source text as parallel columns, one row per primitive in order of
+// its start in the source. Slot k of a row holds value[k] read from [span_start[k], span_end[k]);
+// slots a kind does not use hold 0 and -1. Ids stay with a primitive across edits and reparses
+// that keep it recognizable, so they survive rows being inserted or removed before it.
+struct primitive_table {
+    static constexpr int slot_count = 8;
+
+    std::vector<primitive_kind> kind;
+    std::vector<quint32> id;
+    // From the first '(' or ".." of the primitive to the end of its last group.
+    std::vector<int> start;
+    std::vector<int> end;
+    std::array<std::vector<int>, slot_count> span_start;
+    std::array<std::vector<int>, slot_count> span_end;
+    std::array<std::vector<double>, slot_count> value;
 
-struct bezier_pair {
-    double x0 = 0.0;
-    double y0 = 0.0;
-    double x1 = 0.0;
-    double y1 = 0.0;
-    double x2 = 0.0;
-    double y2 = 0.0;
-    double x3 = 0.0;
-    double y3 = 0.0;
+    int size() const { return static_cast<int>(kind.size()); }
 };
 
-struct bezier_ref {
-    int x0_start = -1;
-    int x0_end = -1;
-    int y0_start = -1;
-    int y0_end = -1;
-    int x1_start = 0;
-    int x1_end = 0;
-    int y1_start = 0;
-    int y1_end = 0;
-    int x2_start = 0;
-    int x2_end = 0;
-    int y2_start = 0;
-    int y2_end = 0;
-    double x0 = 0.0;
-    double y0 = 0.0;
-    double x1 = 0.0;
-    double y1 = 0.0;
-    double x2 = 0.0;
-    double y2 = 0.0;
-    double x3 = 0.0;
-    double y3 = 0.0;
+// Shared read-only between the main window and the canvas.
+using primitive_snapshot_ptr = std::shared_ptr<const primitive_table>;
+
+// Page positions of the world points (0,0), (1,0) and (0,1), in PDF points
+// measured from the bottom-left corner of the first page.
+struct page_anchors {
+    bool valid = false;
+    double origin_x = 0.0;
+    double origin_y = 0.0;
+    double unit_x_x = 0.0;
+    double unit_x_y = 0.0;
+    double unit_y_x = 0.0;
+    double unit_y_y = 0.0;
 };
 
+Q_DECLARE_METATYPE(page_anchors)
+
 #endif
@@ -0,0 +1,9 @@
+#include "parseworker.h"
+
+parseworker::parseworker(QObject *parent) : QObject(parent) {}
+
+void parseworker::parse(quint64 revision, const QString &source) {
+    auto index = std::make_shared<coordinateparser::document_index>();
+    index->reset(source);
+    emit parsed(revision, index);
+}
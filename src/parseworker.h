@@ -0,0 +1,31 @@
+#ifndef PARSEWORKER_H
+#define PARSEWORKER_H
+
+#include <QMetaType>
+#include <QObject>
+#include <QString>
+#include <memory>
+
+#include "coordinateparser.h"
+
+using document_index_ptr = std::shared_ptr<coordinateparser::document_index>;
+
+Q_DECLARE_METATYPE(document_index_ptr)
+
+// Builds the primitive and statement index of a whole source snapshot on a background thread.
+// Each snapshot carries the editor revision it was taken at, so the GUI thread can tell whether
+// the result still describes the document.
+class parseworker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit parseworker(QObject *parent = nullptr);
+
+public slots:
+    void parse(quint64 revision, const QString &source);
+
+signals:
+    void parsed(quint64 revision, const document_index_ptr &index);
+};
+
+#endif
@@ -4,54 +4,371 @@
 #include <QMouseEvent>
 #include <QPainter>
 #include <QPen>
+#include <QRegion>
+#include <QTimer>
 #include <QWheelEvent>
 
+#include <algorithm>
 #include <cmath>
-#include <queue>
+#include <cstring>
+#include <limits>
+#include <utility>
 
-pdfcanvas::pdfcanvas(QWidget *parent) : QWidget(parent) {
+#include "latencytracker.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PDFCANVAS_HAVE_SSE2 1
+#endif
+
+namespace {
+
+struct marker_color {
+    int r;
+    int g;
+    int b;
+};
+
+// Calibration dot colors injected by compileservice, in red/green/blue marker order.
+constexpr marker_color marker_colors[3] = {{253, 17, 251}, {19, 251, 233}, {13, 97, 255}};
+constexpr int marker_max_dist_sq = 30 * 30;
+
+// Whole-page renders are capped at this side length; deeper zoom levels are drawn from tiles.
+constexpr int overview_max_side = 2048;
+constexpr int tile_side = 256;
+constexpr qsizetype tile_cache_budget_bytes = 96 * 1024 * 1024;
+
+// Zoom pyramid levels are whole-page renders at 2^level times the fit scale.
+constexpr int pyramid_min_level = -3;
+constexpr int zoom_idle_ms = 120;
+
+// Screen distance within which a click grabs a marker handle. Handles are filed in square cells
+// of the same size, so every handle within reach of a click lies in the 3x3 cells around it.
+constexpr double handle_hit_px = 10.0;
+
+int handle_cell(double px) {
+    return static_cast<int>(std::floor(px / handle_hit_px));
+}
+
+// Ordered by column, then row, so the cells of one column in a 3x3 block are adjacent.
+quint64 cell_key(int column, int row) {
+    return (static_cast<quint64>(static_cast<quint32>(column) ^ 0x80000000u) << 32) |
+           (static_cast<quint32>(row) ^ 0x80000000u);
+}
+
+void draw_cross(QPainter &painter, const QPointF &p, double half) {
+    painter.drawLine(QPointF(p.x() - half, p.y()), QPointF(p.x() + half, p.y()));
+    painter.drawLine(QPointF(p.x(), p.y() - half), QPointF(p.x(), p.y() + half));
+}
+
+} // namespace
+
+pdfcanvas::pdfcanvas(QWidget *parent) : QWidget(parent), tile_cache_(tile_cache_budget_bytes) {
     setFocusPolicy(Qt::StrongFocus);
+
+    render_worker_ = new pdfrenderworker;
+    render_worker_->moveToThread(&render_thread_);
+    connect(&render_thread_, &QThread::finished, render_worker_, &QObject::deleteLater);
+    connect(render_worker_, &pdfrenderworker::document_loaded, this, &pdfcanvas::on_document_loaded);
+    connect(render_worker_, &pdfrenderworker::load_failed, this, &pdfcanvas::on_load_failed);
+    connect(render_worker_, &pdfrenderworker::first_frame_rendered, this, &pdfcanvas::on_first_frame_rendered);
+    connect(render_worker_, &pdfrenderworker::rendered, this, &pdfcanvas::on_page_rendered);
+    connect(render_worker_, &pdfrenderworker::tile_rendered, this, &pdfcanvas::on_tile_rendered);
+    connect(render_worker_, &pdfrenderworker::level_rendered, this, &pdfcanvas::on_level_rendered);
+    render_thread_.start();
+
+    zoom_idle_timer_ = new QTimer(this);
+    zoom_idle_timer_->setSingleShot(true);
+    zoom_idle_timer_->setInterval(zoom_idle_ms);
+    connect(zoom_idle_timer_, &QTimer::timeout, this, &pdfcanvas::on_zoom_idle);
 }
 
-void pdfcanvas::set_coordinates(const std::vector<coord_pair> &coords) {
-    coordinates_ = coords;
+pdfcanvas::~pdfcanvas() {
+    render_thread_.quit();
+    render_thread_.wait();
+}
+
+void pdfcanvas::set_primitives(primitive_snapshot_ptr primitives) {
+    primitives_ = std::move(primitives);
+    if (drag_row_ >= 0) {
+        // Rows move when the source is edited; the drag follows its primitive by id, or ends when
+        // that primitive is gone.
+        const auto it = std::find(primitives_->id.begin(), primitives_->id.end(), drag_id_);
+        drag_row_ = it == primitives_->id.end() ? -1 : static_cast<int>(it - primitives_->id.begin());
+        if (drag_row_ < 0 || primitives_->kind[drag_row_] != drag_kind_) {
+            drag_row_ = -1;
+            drag_handle_ = handle::none;
+            unsetCursor();
+        }
+    }
+    handle_grid_dirty_ = true;
     update();
 }
 
-void pdfcanvas::set_circles(const std::vector<circle_pair> &circles) {
-    circles_ = circles;
+void pdfcanvas::set_snap_mm(int mm) {
+    snap_mm_ = qMax(0, mm);
+}
+
+void pdfcanvas::set_grid(int step_mm, int extent_cm) {
+    grid_step_mm_ = qMax(0, step_mm);
+    grid_extent_cm_ = qMax(0, extent_cm);
     update();
 }
 
-void pdfcanvas::set_ellipses(const std::vector<ellipse_pair> &ellipses) {
-    ellipses_ = ellipses;
+void pdfcanvas::set_add_line_mode(bool enabled) {
+    add_line_mode_ = enabled;
+}
+
+bool pdfcanvas::has_calibration() const {
+    return page_anchors_.valid || image_calibration_valid_;
+}
+
+void pdfcanvas::load_pdf(const QString &pdf_path, const page_anchors &anchors, quint64 compile_generation) {
+    // The new PDF is loaded and rendered off-screen; the current page stays on screen until
+    // its first frame is ready.
+    pending_document_generation_ = ++document_generation_;
+    pending_anchors_ = anchors;
+    pending_compile_generation_ = compile_generation;
+    const quint64 generation = pending_document_generation_;
+    QMetaObject::invokeMethod(
+        render_worker_,
+        [worker = render_worker_, generation, pdf_path]() { worker->load(generation, pdf_path); },
+        Qt::QueuedConnection);
+}
+
+double pdfcanvas::fit_scale(const QSizeF &scene_size) const {
+    return 0.95 * qMin(width() / scene_size.width(), height() / scene_size.height());
+}
+
+QRectF pdfcanvas::scene_rect(const QSizeF &page_size, const page_anchors &anchors) const {
+    // The visible scene is the page plus the grid extent, both in PDF points from the top-left.
+    QRectF scene(QPointF(0.0, 0.0), page_size);
+    QPointF basis[3];
+    if (grid_extent_cm_ <= 0 || !page_basis(page_size, anchors, basis)) {
+        return scene;
+    }
+    const double half = static_cast<double>(grid_extent_cm_) / 2.0;
+    const QPointF u = basis[1] - basis[0];
+    const QPointF v = basis[2] - basis[0];
+    double left = scene.left();
+    double top = scene.top();
+    double right = scene.right();
+    double bottom = scene.bottom();
+    for (const double gx : {-half, half}) {
+        for (const double gy : {-half, half}) {
+            const QPointF p = basis[0] + u * gx + v * gy;
+            left = qMin(left, p.x());
+            top = qMin(top, p.y());
+            right = qMax(right, p.x());
+            bottom = qMax(bottom, p.y());
+        }
+    }
+    return QRectF(QPointF(left, top), QPointF(right, bottom));
+}
+
+QRect pdfcanvas::page_target_rect(const QSizeF &page_size, const page_anchors &anchors) const {
+    const QRectF scene = scene_rect(page_size, anchors);
+    const double scale = fit_scale(scene.size()) * view_scale_;
+    const int w = qMax(1, static_cast<int>(page_size.width() * scale));
+    const int h = qMax(1, static_cast<int>(page_size.height() * scale));
+    const double scene_left = (width() - scene.width() * scale) * 0.5 + pan_offset_.x();
+    const double scene_top = (height() - scene.height() * scale) * 0.5 + pan_offset_.y();
+    return QRect(static_cast<int>(scene_left - scene.left() * scale),
+                 static_cast<int>(scene_top - scene.top() * scale),
+                 w,
+                 h);
+}
+
+void pdfcanvas::on_document_loaded(quint64 document_generation, const QSizeF &page_size) {
+    if (document_generation != pending_document_generation_) {
+        return;
+    }
+    if (page_size.width() <= 0 || page_size.height() <= 0) {
+        on_load_failed(document_generation);
+        return;
+    }
+    pending_page_size_ = page_size;
+    const QSize size = overview_size_for(page_target_rect(page_size, pending_anchors_).size());
+    QMetaObject::invokeMethod(
+        render_worker_,
+        [worker = render_worker_, document_generation, size]() { worker->render_first_frame(document_generation, size); },
+        Qt::QueuedConnection);
+}
+
+void pdfcanvas::on_load_failed(quint64 document_generation) {
+    if (document_generation != pending_document_generation_) {
+        return;
+    }
+    pending_document_generation_ = 0;
+    emit pdf_load_failed();
+}
+
+void pdfcanvas::on_first_frame_rendered(quint64 document_generation, const QImage &image) {
+    if (document_generation != pending_document_generation_) {
+        return;
+    }
+    if (image.isNull()) {
+        on_load_failed(document_generation);
+        return;
+    }
+    const quint64 compile_generation = pending_compile_generation_;
+    emit phase_reached(compile_generation, static_cast<int>(latency_phase::first_render), latencytracker::now_us());
+    pending_document_generation_ = 0;
+    page_size_ = pending_page_size_;
+    page_anchors_ = pending_anchors_;
+
+    // Everything rendered from the previous document is discarded, including results in flight.
+    rendered_image_ = image;
+    requested_size_ = image.size();
+    shown_generation_ = render_generation_;
+    ++tile_generation_;
+    render_worker_->set_latest_tile_generation(tile_generation_);
+    tile_cache_.clear();
+    pending_tiles_.clear();
+    tile_level_ = QSize();
+    pyramid_.clear();
+    pending_levels_.clear();
+    pyramid_base_ = QSize();
+    ++pyramid_generation_;
+
+    image_calibration_valid_ = false;
+    if (!page_anchors_.valid) {
+        update_calibration();
+    }
+    emit phase_reached(compile_generation, static_cast<int>(latency_phase::calibration), latencytracker::now_us());
+    emit pdf_shown(compile_generation);
     update();
 }
 
-void pdfcanvas::set_beziers(const std::vector<bezier_pair> &beziers) {
-    beziers_ = beziers;
+void pdfcanvas::request_render(const QSize &size) {
+    requested_size_ = size;
+    const quint64 generation = ++render_generation_;
+    render_worker_->set_latest_generation(generation);
+    QMetaObject::invokeMethod(
+        render_worker_,
+        [worker = render_worker_, generation, size]() { worker->render(generation, size); },
+        Qt::QueuedConnection);
+}
+
+void pdfcanvas::on_tile_rendered(quint64 generation, const tile_key &key, const QImage &image) {
+    pending_tiles_.remove(key);
+    if (generation != tile_generation_ || image.isNull()) {
+        return;
+    }
+    tile_cache_.insert(key, new QImage(image), image.sizeInBytes());
     update();
 }
 
-void pdfcanvas::set_rectangles(const std::vector<rectangle_pair> &rectangles) {
-    rectangles_ = rectangles;
+void pdfcanvas::on_level_rendered(quint64 pyramid_generation, int level, const QImage &image) {
+    if (pyramid_generation != pyramid_generation_) {
+        return;
+    }
+    pending_levels_.remove(level);
+    if (image.isNull()) {
+        return;
+    }
+    pyramid_[level] = image;
+    if (zooming_) {
+        update();
+    }
+}
+
+void pdfcanvas::on_zoom_idle() {
+    zooming_ = false;
     update();
 }
 
-void pdfcanvas::set_snap_mm(int mm) {
-    snap_mm_ = qMax(0, mm);
+void pdfcanvas::request_pyramid_levels() {
+    // Keep the levels bracketing the current zoom so the next gesture starts from a close match.
+    const int below = static_cast<int>(std::floor(std::log2(view_scale_)));
+    for (int level = qMax(pyramid_min_level, below); level <= below + 1; ++level) {
+        const double factor = std::ldexp(1.0, level);
+        const QSize size(qMax(1, static_cast<int>(pyramid_base_.width() * factor)),
+                         qMax(1, static_cast<int>(pyramid_base_.height() * factor)));
+        if (overview_size_for(size) != size || pyramid_.count(level) > 0 || pending_levels_.contains(level)) {
+            continue;
+        }
+        pending_levels_.insert(level);
+        const quint64 generation = pyramid_generation_;
+        QMetaObject::invokeMethod(
+            render_worker_,
+            [worker = render_worker_, generation, level, size]() { worker->render_level(generation, level, size); },
+            Qt::QueuedConnection);
+    }
 }
 
-void pdfcanvas::set_add_line_mode(bool enabled) {
-    add_line_mode_ = enabled;
+const QImage &pdfcanvas::backdrop_image(const QSize &overview_size) const {
+    if (rendered_image_.size() == overview_size) {
+        return rendered_image_;
+    }
+    const QImage *best = rendered_image_.isNull() ? nullptr : &rendered_image_;
+    auto distance = [&overview_size](const QImage &image) {
+        return std::abs(std::log2(static_cast<double>(image.width()) / overview_size.width()));
+    };
+    for (const auto &entry : pyramid_) {
+        if (best == nullptr || distance(entry.second) < distance(*best)) {
+            best = &entry.second;
+        }
+    }
+    return best != nullptr ? *best : rendered_image_;
+}
+
+QSize pdfcanvas::overview_size_for(const QSize &target_size) {
+    const int longest = qMax(target_size.width(), target_size.height());
+    if (longest <= overview_max_side) {
+        return target_size;
+    }
+    const double f = static_cast<double>(overview_max_side) / longest;
+    return QSize(qMax(1, static_cast<int>(target_size.width() * f)), qMax(1, static_cast<int>(target_size.height() * f)));
 }
 
-bool pdfcanvas::load_pdf(const QString &pdf_path) {
-    rendered_image_ = QImage();
-    rendered_size_ = QSize();
-    const QPdfDocument::Error err = pdf_document_.load(pdf_path);
+std::vector<std::pair<QRect, const QImage *>> pdfcanvas::visible_tiles(const QRect &target_rect) {
+    if (tile_level_ != target_rect.size()) {
+        // A new zoom level: requests for the previous one are dropped by the worker.
+        tile_level_ = target_rect.size();
+        ++tile_generation_;
+        render_worker_->set_latest_tile_generation(tile_generation_);
+        pending_tiles_.clear();
+    }
+
+    std::vector<std::pair<QRect, const QImage *>> tiles;
+    const QRect local = target_rect.intersected(rect()).translated(-target_rect.topLeft());
+    if (local.isEmpty()) {
+        return tiles;
+    }
+    const QRect page_rect(QPoint(0, 0), tile_level_);
+    for (int ty = local.top() / tile_side; ty <= local.bottom() / tile_side; ++ty) {
+        for (int tx = local.left() / tile_side; tx <= local.right() / tile_side; ++tx) {
+            const tile_key key{0, tile_level_.width(), tile_level_.height(), tx, ty};
+            const QRect clip = QRect(tx * tile_side, ty * tile_side, tile_side, tile_side).intersected(page_rect);
+            if (const QImage *tile = tile_cache_.object(key)) {
+                tiles.emplace_back(clip.translated(target_rect.topLeft()), tile);
+            } else if (!pending_tiles_.contains(key)) {
+                pending_tiles_.insert(key);
+                const quint64 generation = tile_generation_;
+                const QSize page_size = tile_level_;
+                QMetaObject::invokeMethod(
+                    render_worker_,
+                    [worker = render_worker_, generation, key, page_size, clip]() {
+                        worker->render_tile(generation, key, page_size, clip);
+                    },
+                    Qt::QueuedConnection);
+            }
+        }
+    }
+    return tiles;
+}
+
+void pdfcanvas::on_page_rendered(quint64 generation, const QImage &image) {
+    if (generation <= shown_generation_ || image.isNull()) {
+        return;
+    }
+    shown_generation_ = generation;
+    rendered_image_ = image;
+    if (!page_anchors_.valid) {
+        update_calibration();
+    }
     update();
-    return err == QPdfDocument::Error::None;
 }
 
 void pdfcanvas::paintEvent(QPaintEvent *event) {
@@ -60,43 +377,76 @@ void pdfcanvas::paintEvent(QPaintEvent *event) {
     QPainter painter(this);
     painter.fillRect(rect(), palette().color(QPalette::Window));
 
-    if (pdf_document_.status() != QPdfDocument::Status::Ready || pdf_document_.pageCount() <= 0) {
+    if (page_size_.isEmpty()) {
         painter.setPen(palette().color(QPalette::Text));
         painter.drawText(rect(), Qt::AlignCenter, "Compile to preview output");
         return;
     }
 
-    const QSizeF page_size = pdf_document_.pagePointSize(0);
-    if (page_size.width() <= 0 || page_size.height() <= 0) {
-        return;
+    const QSizeF page_size = page_size_;
+    const QRectF scene = scene_rect(page_size, page_anchors_);
+    const double fit = fit_scale(scene.size());
+    const double scale = fit * view_scale_;
+    const QRect target_rect = page_target_rect(page_size, page_anchors_);
+    apply_calibration(target_rect, page_size);
+
+    // The PDF image is transparent, so the grid is drawn on the white scene underneath it.
+    const QRectF scene_screen(target_rect.left() + scene.left() * scale,
+                              target_rect.top() + scene.top() * scale,
+                              scene.width() * scale,
+                              scene.height() * scale);
+    painter.fillRect(scene_screen.united(QRectF(target_rect)), QColor("#ffffff"));
+    draw_grid(painter);
+
+    const QSize pyramid_base(qMax(1, static_cast<int>(page_size.width() * fit)),
+                             qMax(1, static_cast<int>(page_size.height() * fit)));
+    if (pyramid_base_ != pyramid_base) {
+        pyramid_.clear();
+        pending_levels_.clear();
+        pyramid_base_ = pyramid_base;
+        ++pyramid_generation_;
     }
 
-    const double fit = 0.95 * qMin(width() / page_size.width(), height() / page_size.height());
-    const double scale = fit * view_scale_;
-    const int w = qMax(1, static_cast<int>(page_size.width() * scale));
-    const int h = qMax(1, static_cast<int>(page_size.height() * scale));
-    const QRect target_rect(static_cast<int>((width() - w) * 0.5 + pan_offset_.x()),
-                            static_cast<int>((height() - h) * 0.5 + pan_offset_.y()),
-                            w,
-                            h);
-    painter.fillRect(target_rect, QColor("#ffffff"));
+    // Rasterization runs on the render thread; until the exact size arrives, the closest cached
+    // image is drawn scaled to the new target. While the wheel is moving no renders are requested.
+    // Past the overview cap only visible tiles are rendered.
+    const QSize overview_size = overview_size_for(target_rect.size());
+    if (!zooming_) {
+        if (requested_size_ != overview_size && rendered_image_.size() != overview_size) {
+            request_render(overview_size);
+        }
+        request_pyramid_levels();
+    }
 
-    if (rendered_image_.isNull() || rendered_size_ != target_rect.size()) {
-        rendered_image_ = pdf_document_.render(0, target_rect.size());
-        rendered_size_ = target_rect.size();
+    std::vector<std::pair<QRect, const QImage *>> tiles;
+    if (!zooming_ && overview_size != target_rect.size()) {
+        tiles = visible_tiles(target_rect);
     }
 
-    if (!rendered_image_.isNull()) {
+    const QImage &backdrop = backdrop_image(overview_size);
+    const QRect visible = target_rect.intersected(rect());
+    if (!backdrop.isNull() && !visible.isEmpty()) {
+        QRegion backdrop_region(visible);
+        for (const auto &tile : tiles) {
+            backdrop_region -= tile.first;
+        }
+        painter.save();
+        painter.setClipRegion(backdrop_region);
         painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
-        painter.drawImage(target_rect, rendered_image_);
+        const double ix = static_cast<double>(backdrop.width()) / target_rect.width();
+        const double iy = static_cast<double>(backdrop.height()) / target_rect.height();
+        const QRectF source((visible.left() - target_rect.left()) * ix,
+                            (visible.top() - target_rect.top()) * iy,
+                            visible.width() * ix,
+                            visible.height() * iy);
+        painter.drawImage(QRectF(visible), backdrop, source);
+        painter.restore();
+    }
+    for (const auto &tile : tiles) {
+        painter.drawImage(tile.first.topLeft(), *tile.second);
     }
 
-    update_calibration(target_rect);
-    draw_coordinate_markers(painter);
-    draw_circle_markers(painter);
-    draw_ellipse_markers(painter);
-    draw_bezier_markers(painter);
-    draw_rectangle_markers(painter);
+    draw_markers(painter);
 }
 
 void pdfcanvas::wheelEvent(QWheelEvent *event) {
@@ -109,8 +459,8 @@ void pdfcanvas::wheelEvent(QWheelEvent *event) {
     const double steps = static_cast<double>(delta.y()) / 120.0;
     view_scale_ *= std::pow(1.12, steps);
     view_scale_ = qBound(0.2, view_scale_, 12.0);
-    rendered_image_ = QImage();
-    rendered_size_ = QSize();
+    zooming_ = true;
+    zoom_idle_timer_->start();
     update();
     event->accept();
 }
@@ -130,74 +480,30 @@ void pdfcanvas::mousePressEvent(QMouseEvent *event) {
                 return;
             }
         }
-        if (calibration_valid_) {
-            const int rect_idx = hit_test_rectangle_marker(event->position());
-            if (rect_idx >= 0) {
-                emit selection_changed("rectangle", rect_idx, -1);
-                rectangle_dragging_ = true;
-                active_rectangle_index_ = rect_idx;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
-            }
-            const int circle_idx = hit_test_circle_marker(event->position());
-            if (circle_idx >= 0) {
-                emit selection_changed("circle", circle_idx, -1);
-                circle_dragging_ = true;
-                active_circle_index_ = circle_idx;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
-            }
-            const int ellipse_rx_idx = hit_test_ellipse_rx_marker(event->position());
-            if (ellipse_rx_idx >= 0) {
-                emit selection_changed("ellipse", ellipse_rx_idx, 0);
-                ellipse_dragging_ = true;
-                active_ellipse_index_ = ellipse_rx_idx;
-                ellipse_dragging_rx_ = true;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
-            }
-            const int ellipse_ry_idx = hit_test_ellipse_ry_marker(event->position());
-            if (ellipse_ry_idx >= 0) {
-                emit selection_changed("ellipse", ellipse_ry_idx, 1);
-                ellipse_dragging_ = true;
-                active_ellipse_index_ = ellipse_ry_idx;
-                ellipse_dragging_rx_ = false;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
-            }
-            const int bezier_c1_idx = hit_test_bezier_c1_marker(event->position());
-            if (bezier_c1_idx >= 0) {
-                emit selection_changed("bezier", bezier_c1_idx, 1);
-                bezier_dragging_ = true;
-                active_bezier_index_ = bezier_c1_idx;
-                bezier_dragging_c1_ = true;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
-            }
-            const int bezier_c2_idx = hit_test_bezier_c2_marker(event->position());
-            if (bezier_c2_idx >= 0) {
-                emit selection_changed("bezier", bezier_c2_idx, 2);
-                bezier_dragging_ = true;
-                active_bezier_index_ = bezier_c2_idx;
-                bezier_dragging_c1_ = false;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
+        int row = -1;
+        handle h = handle::none;
+        if (calibration_valid_ && hit_test_handle(event->position(), row, h)) {
+            if (h == handle::rectangle_corner) {
+                emit selection_changed("rectangle", row, -1);
+            } else if (h == handle::circle_radius) {
+                emit selection_changed("circle", row, -1);
+            } else if (h == handle::ellipse_rx || h == handle::ellipse_ry) {
+                emit selection_changed("ellipse", row, h == handle::ellipse_rx ? 0 : 1);
+            } else if (h == handle::bezier_c1 || h == handle::bezier_c2) {
+                emit selection_changed("bezier", row, h == handle::bezier_c1 ? 1 : 2);
+            } else {
+                emit selection_changed("coordinate", row, -1);
             }
-            const int idx = hit_test_marker(event->position());
-            if (idx >= 0) {
-                emit selection_changed("coordinate", idx, -1);
-                marker_dragging_ = true;
-                active_marker_index_ = idx;
-                setCursor(Qt::CrossCursor);
-                event->accept();
-                return;
+            drag_row_ = row;
+            drag_id_ = primitives_->id[row];
+            drag_kind_ = primitives_->kind[row];
+            drag_handle_ = h;
+            for (int slot = 0; slot < primitive_table::slot_count; ++slot) {
+                drag_values_[slot] = primitives_->value[slot][row];
             }
+            setCursor(Qt::CrossCursor);
+            event->accept();
+            return;
         }
         emit selection_changed(QString(), -1, -1);
         dragging_ = true;
@@ -210,99 +516,32 @@ void pdfcanvas::mousePressEvent(QMouseEvent *event) {
 }
 
 void pdfcanvas::mouseMoveEvent(QMouseEvent *event) {
-    if (rectangle_dragging_ && active_rectangle_index_ >= 0 &&
-        active_rectangle_index_ < static_cast<int>(rectangles_.size())) {
-        QPointF world;
-        if (screen_to_world(event->position(), world)) {
-            if (snap_mm_ > 0) {
-                const double step = static_cast<double>(snap_mm_) / 10.0;
-                world.setX(std::round(world.x() / step) * step);
-                world.setY(std::round(world.y() / step) * step);
-            }
-            rectangles_[active_rectangle_index_].x2 = world.x();
-            rectangles_[active_rectangle_index_].y2 = world.y();
-            update();
-        }
-        event->accept();
-        return;
-    }
-
-    if (circle_dragging_ && active_circle_index_ >= 0 && active_circle_index_ < static_cast<int>(circles_.size())) {
+    if (drag_row_ >= 0) {
         QPointF world;
         if (screen_to_world(event->position(), world)) {
-            const circle_pair c = circles_[active_circle_index_];
-            double r = std::hypot(world.x() - c.cx, world.y() - c.cy);
-            if (snap_mm_ > 0) {
-                const double step = static_cast<double>(snap_mm_) / 10.0;
-                r = std::round(r / step) * step;
-            }
-            circles_[active_circle_index_].r = qMax(0.01, r);
-            update();
-        }
-        event->accept();
-        return;
-    }
-
-    if (ellipse_dragging_ && active_ellipse_index_ >= 0 && active_ellipse_index_ < static_cast<int>(ellipses_.size())) {
-        QPointF world;
-        if (screen_to_world(event->position(), world)) {
-            ellipse_pair e = ellipses_[active_ellipse_index_];
-            if (ellipse_dragging_rx_) {
-                double rx = std::abs(world.x() - e.cx);
-                if (snap_mm_ > 0) {
-                    const double step = static_cast<double>(snap_mm_) / 10.0;
-                    rx = std::round(rx / step) * step;
-                }
-                e.rx = qMax(0.01, rx);
+            const double step = static_cast<double>(snap_mm_) / 10.0;
+            const auto snap = [this, step](double v) { return snap_mm_ > 0 ? std::round(v / step) * step : v; };
+            std::array<double, primitive_table::slot_count> &v = drag_values_;
+            if (drag_handle_ == handle::circle_radius) {
+                const double r = std::hypot(world.x() - v[circle_slot::cx], world.y() - v[circle_slot::cy]);
+                v[circle_slot::r] = qMax(0.01, snap(r));
+            } else if (drag_handle_ == handle::ellipse_rx) {
+                v[ellipse_slot::rx] = qMax(0.01, snap(std::abs(world.x() - v[ellipse_slot::cx])));
+            } else if (drag_handle_ == handle::ellipse_ry) {
+                v[ellipse_slot::ry] = qMax(0.01, snap(std::abs(world.y() - v[ellipse_slot::cy])));
             } else {
-                double ry = std::abs(world.y() - e.cy);
-                if (snap_mm_ > 0) {
-                    const double step = static_cast<double>(snap_mm_) / 10.0;
-                    ry = std::round(ry / step) * step;
+                // The remaining handles move one point, stored as an x slot followed by its y slot.
+                int x_slot = coordinate_slot::x;
+                if (drag_handle_ == handle::rectangle_corner) {
+                    x_slot = rectangle_slot::x2;
+                } else if (drag_handle_ == handle::bezier_c1) {
+                    x_slot = bezier_slot::x1;
+                } else if (drag_handle_ == handle::bezier_c2) {
+                    x_slot = bezier_slot::x2;
                 }
-                e.ry = qMax(0.01, ry);
-            }
-            ellipses_[active_ellipse_index_] = e;
-            update();
-        }
-        event->accept();
-        return;
-    }
-
-    if (bezier_dragging_ && active_bezier_index_ >= 0 && active_bezier_index_ < static_cast<int>(beziers_.size())) {
-        QPointF world;
-        if (screen_to_world(event->position(), world)) {
-            if (snap_mm_ > 0) {
-                const double step = static_cast<double>(snap_mm_) / 10.0;
-                world.setX(std::round(world.x() / step) * step);
-                world.setY(std::round(world.y() / step) * step);
+                v[x_slot] = snap(world.x());
+                v[x_slot + 1] = snap(world.y());
             }
-
-            bezier_pair b = beziers_[active_bezier_index_];
-            if (bezier_dragging_c1_) {
-                b.x1 = world.x();
-                b.y1 = world.y();
-            } else {
-                b.x2 = world.x();
-                b.y2 = world.y();
-            }
-            beziers_[active_bezier_index_] = b;
-            update();
-        }
-        event->accept();
-        return;
-    }
-
-    if (marker_dragging_ && active_marker_index_ >= 0 && active_marker_index_ < static_cast<int>(coordinates_.size())) {
-        QPointF world;
-        if (screen_to_world(event->position(), world)) {
-            if (snap_mm_ > 0) {
-                const double step = static_cast<double>(snap_mm_) / 10.0;
-                world.setX(std::round(world.x() / step) * step);
-                world.setY(std::round(world.y() / step) * step);
-            }
-            coordinates_[active_marker_index_].x = world.x();
-            coordinates_[active_marker_index_].y = world.y();
             update();
         }
         event->accept();
@@ -322,66 +561,26 @@ void pdfcanvas::mouseMoveEvent(QMouseEvent *event) {
 }
 
 void pdfcanvas::mouseReleaseEvent(QMouseEvent *event) {
-    if (event->button() == Qt::LeftButton && rectangle_dragging_) {
-        rectangle_dragging_ = false;
+    if (event->button() == Qt::LeftButton && drag_row_ >= 0) {
+        const quint32 id = drag_id_;
+        const handle h = drag_handle_;
+        const std::array<double, primitive_table::slot_count> v = drag_values_;
+        drag_row_ = -1;
+        drag_handle_ = handle::none;
         unsetCursor();
-        if (active_rectangle_index_ >= 0 && active_rectangle_index_ < static_cast<int>(rectangles_.size())) {
-            const rectangle_pair &r = rectangles_[active_rectangle_index_];
-            emit rectangle_corner_dragged(active_rectangle_index_, r.x2, r.y2);
+        if (h == handle::rectangle_corner) {
+            emit rectangle_corner_dragged(id, v[rectangle_slot::x2], v[rectangle_slot::y2]);
+        } else if (h == handle::circle_radius) {
+            emit circle_radius_dragged(id, v[circle_slot::r]);
+        } else if (h == handle::ellipse_rx || h == handle::ellipse_ry) {
+            emit ellipse_radii_dragged(id, v[ellipse_slot::rx], v[ellipse_slot::ry]);
+        } else if (h == handle::bezier_c1) {
+            emit bezier_control_dragged(id, 1, v[bezier_slot::x1], v[bezier_slot::y1]);
+        } else if (h == handle::bezier_c2) {
+            emit bezier_control_dragged(id, 2, v[bezier_slot::x2], v[bezier_slot::y2]);
+        } else {
+            emit coordinate_dragged(id, v[coordinate_slot::x], v[coordinate_slot::y]);
         }
-        active_rectangle_index_ = -1;
-        event->accept();
-        return;
-    }
-
-    if (event->button() == Qt::LeftButton && circle_dragging_) {
-        circle_dragging_ = false;
-        unsetCursor();
-        if (active_circle_index_ >= 0 && active_circle_index_ < static_cast<int>(circles_.size())) {
-            const circle_pair &c = circles_[active_circle_index_];
-            emit circle_radius_dragged(active_circle_index_, c.r);
-        }
-        active_circle_index_ = -1;
-        event->accept();
-        return;
-    }
-
-    if (event->button() == Qt::LeftButton && ellipse_dragging_) {
-        ellipse_dragging_ = false;
-        unsetCursor();
-        if (active_ellipse_index_ >= 0 && active_ellipse_index_ < static_cast<int>(ellipses_.size())) {
-            const ellipse_pair &e = ellipses_[active_ellipse_index_];
-            emit ellipse_radii_dragged(active_ellipse_index_, e.rx, e.ry);
-        }
-        active_ellipse_index_ = -1;
-        event->accept();
-        return;
-    }
-
-    if (event->button() == Qt::LeftButton && bezier_dragging_) {
-        bezier_dragging_ = false;
-        unsetCursor();
-        if (active_bezier_index_ >= 0 && active_bezier_index_ < static_cast<int>(beziers_.size())) {
-            const bezier_pair &b = beziers_[active_bezier_index_];
-            if (bezier_dragging_c1_) {
-                emit bezier_control_dragged(active_bezier_index_, 1, b.x1, b.y1);
-            } else {
-                emit bezier_control_dragged(active_bezier_index_, 2, b.x2, b.y2);
-            }
-        }
-        active_bezier_index_ = -1;
-        event->accept();
-        return;
-    }
-
-    if (event->button() == Qt::LeftButton && marker_dragging_) {
-        marker_dragging_ = false;
-        unsetCursor();
-        if (active_marker_index_ >= 0 && active_marker_index_ < static_cast<int>(coordinates_.size())) {
-            const coord_pair &c = coordinates_[active_marker_index_];
-            emit coordinate_dragged(active_marker_index_, c.x, c.y);
-        }
-        active_marker_index_ = -1;
         event->accept();
         return;
     }
@@ -403,120 +602,180 @@ bool pdfcanvas::is_near_color(int r, int g, int b, int tr, int tg, int tb, int m
     return (dr * dr + dg * dg + db * db) <= max_dist_sq;
 }
 
-std::vector<QPointF> pdfcanvas::find_color_centroids(const QImage &img, char target) {
-    std::vector<QPointF> out;
-    if (img.isNull()) {
-        return out;
+void pdfcanvas::classify_marker_row(const QRgb *row, int x0, int x1, unsigned char *out) {
+    int x = x0;
+#ifdef PDFCANVAS_HAVE_SSE2
+    // Four pixels per step: widen BGRX bytes to 16 bit, square-and-sum the channel differences
+    // with madd, and compare all three target colors before packing the class codes to bytes.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+    const __m128i limit = _mm_set1_epi32(marker_max_dist_sq + 1);
+    __m128i targets[3];
+    for (int k = 0; k < 3; ++k) {
+        const marker_color &c = marker_colors[k];
+        targets[k] = _mm_setr_epi16(static_cast<short>(c.b), static_cast<short>(c.g), static_cast<short>(c.r), 0,
+                                    static_cast<short>(c.b), static_cast<short>(c.g), static_cast<short>(c.r), 0);
     }
-
-    int tr = 0;
-    int tg = 0;
-    int tb = 0;
-    if (target == 'r') {
-        tr = 253; tg = 17; tb = 251;
-    } else if (target == 'g') {
-        tr = 19; tg = 251; tb = 233;
-    } else if (target == 'b') {
-        tr = 13; tg = 97; tb = 255;
-    }
-
-    const int max_dist_sq = 30 * 30;
-    const int w = img.width();
-    const int h = img.height();
-    std::vector<unsigned char> mask(static_cast<size_t>(w) * static_cast<size_t>(h), 0);
-    std::vector<unsigned char> visited(static_cast<size_t>(w) * static_cast<size_t>(h), 0);
-
-    for (int y = 0; y < img.height(); ++y) {
-        const QRgb *row = reinterpret_cast<const QRgb *>(img.constScanLine(y));
-        for (int x = 0; x < img.width(); ++x) {
-            const int r = qRed(row[x]);
-            const int g = qGreen(row[x]);
-            const int b = qBlue(row[x]);
-            if (is_near_color(r, g, b, tr, tg, tb, max_dist_sq)) {
-                mask[static_cast<size_t>(y) * static_cast<size_t>(w) + static_cast<size_t>(x)] = 1;
+    for (; x + 4 <= x1; x += 4) {
+        const __m128i px = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x)), rgb_mask);
+        const __m128i lo = _mm_unpacklo_epi8(px, zero);
+        const __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128i cls = zero;
+        for (int k = 0; k < 3; ++k) {
+            const __m128i dlo = _mm_sub_epi16(lo, targets[k]);
+            const __m128i dhi = _mm_sub_epi16(hi, targets[k]);
+            __m128i slo = _mm_madd_epi16(dlo, dlo);
+            __m128i shi = _mm_madd_epi16(dhi, dhi);
+            slo = _mm_add_epi32(slo, _mm_shuffle_epi32(slo, _MM_SHUFFLE(2, 3, 0, 1)));
+            shi = _mm_add_epi32(shi, _mm_shuffle_epi32(shi, _MM_SHUFFLE(2, 3, 0, 1)));
+            const __m128i dist = _mm_unpacklo_epi64(_mm_shuffle_epi32(slo, _MM_SHUFFLE(3, 1, 2, 0)),
+                                                    _mm_shuffle_epi32(shi, _MM_SHUFFLE(3, 1, 2, 0)));
+            const __m128i hit = _mm_andnot_si128(_mm_cmpgt_epi32(cls, zero), _mm_cmplt_epi32(dist, limit));
+            cls = _mm_or_si128(cls, _mm_and_si128(hit, _mm_set1_epi32(k + 1)));
+        }
+        __m128i packed = _mm_packs_epi32(cls, cls);
+        packed = _mm_packus_epi16(packed, packed);
+        const int bytes = _mm_cvtsi128_si32(packed);
+        std::memcpy(out + (x - x0), &bytes, sizeof(bytes));
+    }
+#endif
+    for (; x < x1; ++x) {
+        const int r = qRed(row[x]);
+        const int g = qGreen(row[x]);
+        const int b = qBlue(row[x]);
+        unsigned char cls = 0;
+        for (int k = 0; k < 3; ++k) {
+            const marker_color &c = marker_colors[k];
+            if (is_near_color(r, g, b, c.r, c.g, c.b, marker_max_dist_sq)) {
+                cls = static_cast<unsigned char>(k + 1);
+                break;
             }
         }
+        out[x - x0] = cls;
     }
+}
 
-    static const int dx[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
-    static const int dy[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
-    constexpr int min_component_pixels = 1;
-
-    for (int y = 0; y < h; ++y) {
+std::array<std::vector<QPointF>, 3> pdfcanvas::find_marker_centroids(const QImage &img, const QRect &window) {
+    std::array<std::vector<QPointF>, 3> out;
+    const QRect area = window.intersected(img.rect());
+    if (img.isNull() || area.isEmpty()) {
+        return out;
+    }
+    const QImage src = img.depth() == 32 ? img : img.convertToFormat(QImage::Format_ARGB32);
+    const int x0 = area.left();
+    const int y0 = area.top();
+    const int w = area.width();
+
+    // Single pass: classify a row against all marker colors, then label it against the previous
+    // row (8-connectivity). Provisional labels are merged with union-find and carry their own
+    // centroid sums, so only two rows of state are kept instead of full-image masks.
+    struct component {
+        int parent;
+        int cls;
+        double sx;
+        double sy;
+        int count;
+    };
+    std::vector<component> comps;
+    auto find_root = [&comps](int a) {
+        while (comps[a].parent != a) {
+            comps[a].parent = comps[comps[a].parent].parent;
+            a = comps[a].parent;
+        }
+        return a;
+    };
+    auto unite = [&comps, &find_root](int a, int b) {
+        a = find_root(a);
+        b = find_root(b);
+        if (a == b) {
+            return a;
+        }
+        if (b < a) {
+            std::swap(a, b);
+        }
+        comps[b].parent = a;
+        return a;
+    };
+
+    std::vector<unsigned char> prev_cls(static_cast<size_t>(w), 0);
+    std::vector<unsigned char> cur_cls(static_cast<size_t>(w), 0);
+    std::vector<int> prev_labels(static_cast<size_t>(w), -1);
+    std::vector<int> cur_labels(static_cast<size_t>(w), -1);
+
+    for (int y = y0; y <= area.bottom(); ++y) {
+        const QRgb *row = reinterpret_cast<const QRgb *>(src.constScanLine(y));
+        classify_marker_row(row, x0, x0 + w, cur_cls.data());
         for (int x = 0; x < w; ++x) {
-            const size_t idx = static_cast<size_t>(y) * static_cast<size_t>(w) + static_cast<size_t>(x);
-            if (!mask[idx] || visited[idx]) {
+            const int c = cur_cls[x];
+            if (c == 0) {
+                cur_labels[x] = -1;
                 continue;
             }
 
-            std::queue<QPoint> q;
-            q.push(QPoint(x, y));
-            visited[idx] = 1;
-
-            double sx = 0.0;
-            double sy = 0.0;
-            int count = 0;
-
-            while (!q.empty()) {
-                const QPoint p = q.front();
-                q.pop();
-                sx += static_cast<double>(p.x());
-                sy += static_cast<double>(p.y());
-                ++count;
-
-                for (int k = 0; k < 8; ++k) {
-                    const int nx = p.x() + dx[k];
-                    const int ny = p.y() + dy[k];
-                    if (nx < 0 || ny < 0 || nx >= w || ny >= h) {
-                        continue;
-                    }
-                    const size_t nidx = static_cast<size_t>(ny) * static_cast<size_t>(w) + static_cast<size_t>(nx);
-                    if (!mask[nidx] || visited[nidx]) {
-                        continue;
+            int label = -1;
+            auto join = [&](int other) {
+                if (other >= 0) {
+                    label = label < 0 ? find_root(other) : unite(label, other);
+                }
+            };
+            if (x > 0 && cur_cls[x - 1] == c) {
+                join(cur_labels[x - 1]);
+            }
+            if (y > y0) {
+                for (int nx = qMax(0, x - 1); nx <= qMin(w - 1, x + 1); ++nx) {
+                    if (prev_cls[nx] == c) {
+                        join(prev_labels[nx]);
                     }
-                    visited[nidx] = 1;
-                    q.push(QPoint(nx, ny));
                 }
             }
-
-            if (count >= min_component_pixels) {
-                out.push_back(QPointF(sx / count, sy / count));
+            if (label < 0) {
+                label = static_cast<int>(comps.size());
+                comps.push_back({label, c, 0.0, 0.0, 0});
             }
+            comps[label].sx += static_cast<double>(x0 + x);
+            comps[label].sy += static_cast<double>(y);
+            ++comps[label].count;
+            cur_labels[x] = label;
         }
+        std::swap(prev_cls, cur_cls);
+        std::swap(prev_labels, cur_labels);
     }
 
-    return out;
-}
-
-void pdfcanvas::update_calibration(const QRect &target_rect) {
-    calibration_valid_ = false;
-    if (rendered_image_.isNull() || !target_rect.isValid()) {
-        return;
+    // Roots always carry the smallest label, so one ascending sweep folds every sum into its root.
+    for (int i = 0; i < static_cast<int>(comps.size()); ++i) {
+        const int root = find_root(i);
+        if (root != i) {
+            comps[root].sx += comps[i].sx;
+            comps[root].sy += comps[i].sy;
+            comps[root].count += comps[i].count;
+        }
     }
-
-    const std::vector<QPointF> r_candidates = find_color_centroids(rendered_image_, 'r');
-    const std::vector<QPointF> g_candidates = find_color_centroids(rendered_image_, 'g');
-    const std::vector<QPointF> b_candidates = find_color_centroids(rendered_image_, 'b');
-    if (r_candidates.empty() || g_candidates.empty() || b_candidates.empty()) {
-        return;
+    for (int i = 0; i < static_cast<int>(comps.size()); ++i) {
+        const component &comp = comps[i];
+        if (comp.parent == i && comp.count > 0) {
+            out[comp.cls - 1].push_back(QPointF(comp.sx / comp.count, comp.sy / comp.count));
+        }
     }
+    return out;
+}
 
-    QPointF red_local;
-    QPointF green_local;
-    QPointF blue_local;
+bool pdfcanvas::pick_marker_triple(const std::array<std::vector<QPointF>, 3> &candidates,
+                                   QPointF &red_out,
+                                   QPointF &green_out,
+                                   QPointF &blue_out) {
     double best_score = 1e18;
     bool found = false;
 
     // Choose the RGB triple that best matches the expected local basis:
     // vectors (R->G) and (R->B) should be close to orthogonal and similar length.
-    for (const QPointF &r : r_candidates) {
-        for (const QPointF &g : g_candidates) {
+    for (const QPointF &r : candidates[0]) {
+        for (const QPointF &g : candidates[1]) {
             const QPointF u = g - r;
             const double lu = std::hypot(u.x(), u.y());
             if (lu < 2.0) {
                 continue;
             }
-            for (const QPointF &b : b_candidates) {
+            for (const QPointF &b : candidates[2]) {
                 const QPointF v = b - r;
                 const double lv = std::hypot(v.x(), v.y());
                 if (lv < 2.0) {
@@ -532,28 +791,182 @@ void pdfcanvas::update_calibration(const QRect &target_rect) {
                 const double score = ortho * 2.0 + len_balance;
                 if (score < best_score) {
                     best_score = score;
-                    red_local = r;
-                    green_local = g;
-                    blue_local = b;
+                    red_out = r;
+                    green_out = g;
+                    blue_out = b;
                     found = true;
                 }
             }
         }
     }
+    return found;
+}
+
+void pdfcanvas::update_calibration() {
+    const bool had_previous = image_calibration_valid_ && calibrated_image_size_.isValid();
+    const QSize previous_size = calibrated_image_size_;
+    const QPointF previous_points[3] = {image_origin_px_, image_axis_x_px_, image_axis_y_px_};
+    image_calibration_valid_ = false;
+    if (rendered_image_.isNull()) {
+        return;
+    }
+
+    QPointF red_local;
+    QPointF green_local;
+    QPointF blue_local;
+    bool found = false;
+
+    if (had_previous) {
+        // The image always spans the whole page, so the previous dots move by the zoom ratio.
+        // Search a small window around each prediction before falling back to a full scan.
+        const double kx = static_cast<double>(rendered_image_.width()) / previous_size.width();
+        const double ky = static_cast<double>(rendered_image_.height()) / previous_size.height();
+        const QPointF u = previous_points[1] - previous_points[0];
+        const double unit_px = std::hypot(u.x() * kx, u.y() * ky);
+        // Dots have a 2pt radius, i.e. about 0.07 of the 1 cm unit.
+        const double dot_radius_px = unit_px * 0.07;
+        const int half = static_cast<int>(std::ceil(dot_radius_px * 3.0)) + 6;
+        const double max_offset = half - dot_radius_px - 1.0;
+        std::array<std::vector<QPointF>, 3> candidates;
+        bool all_hit = true;
+        for (int k = 0; k < 3 && all_hit; ++k) {
+            const QPoint predicted(static_cast<int>(std::lround(previous_points[k].x() * kx)),
+                                   static_cast<int>(std::lround(previous_points[k].y() * ky)));
+            const QRect window(predicted.x() - half, predicted.y() - half, 2 * half + 1, 2 * half + 1);
+            // Only keep dots lying wholly inside the window; a clipped dot has a biased centroid.
+            for (const QPointF &p : find_marker_centroids(rendered_image_, window)[k]) {
+                if (std::abs(p.x() - predicted.x()) <= max_offset && std::abs(p.y() - predicted.y()) <= max_offset) {
+                    candidates[k].push_back(p);
+                }
+            }
+            all_hit = !candidates[k].empty();
+        }
+        found = all_hit && pick_marker_triple(candidates, red_local, green_local, blue_local);
+    }
 
+    if (!found) {
+        const std::array<std::vector<QPointF>, 3> candidates =
+            find_marker_centroids(rendered_image_, rendered_image_.rect());
+        found = pick_marker_triple(candidates, red_local, green_local, blue_local);
+    }
     if (!found) {
         return;
     }
 
-    const QPointF top_left = target_rect.topLeft();
-    origin_px_ = top_left + red_local;
-    axis_x_px_ = top_left + green_local;
-    axis_y_px_ = top_left + blue_local;
+    image_origin_px_ = red_local;
+    image_axis_x_px_ = green_local;
+    image_axis_y_px_ = blue_local;
+    calibrated_image_size_ = rendered_image_.size();
 
+    const QPointF u = image_axis_x_px_ - image_origin_px_;
+    const QPointF v = image_axis_y_px_ - image_origin_px_;
+    const double det = u.x() * v.y() - u.y() * v.x();
+    image_calibration_valid_ = std::abs(det) > 1e-6;
+}
+
+bool pdfcanvas::page_basis(const QSizeF &page_size, const page_anchors &anchors, QPointF basis_out[3]) const {
+    if (anchors.valid) {
+        // Exact anchors from the compile log, flipped from the PDF's bottom-left origin.
+        basis_out[0] = QPointF(anchors.origin_x, page_size.height() - anchors.origin_y);
+        basis_out[1] = QPointF(anchors.unit_x_x, page_size.height() - anchors.unit_x_y);
+        basis_out[2] = QPointF(anchors.unit_y_x, page_size.height() - anchors.unit_y_y);
+        return true;
+    }
+
+    // The image-local basis is computed once per rendered image; panning only translates it, and
+    // while a re-render is pending it is scaled along with the stretched image.
+    if (!image_calibration_valid_ || calibrated_image_size_.isEmpty()) {
+        return false;
+    }
+    const double sx = page_size.width() / calibrated_image_size_.width();
+    const double sy = page_size.height() / calibrated_image_size_.height();
+    basis_out[0] = QPointF(image_origin_px_.x() * sx, image_origin_px_.y() * sy);
+    basis_out[1] = QPointF(image_axis_x_px_.x() * sx, image_axis_x_px_.y() * sy);
+    basis_out[2] = QPointF(image_axis_y_px_.x() * sx, image_axis_y_px_.y() * sy);
+    return true;
+}
+
+void pdfcanvas::apply_calibration(const QRect &target_rect, const QSizeF &page_size) {
+    QPointF basis[3];
+    calibration_valid_ = target_rect.isValid() && page_size.width() > 0 && page_size.height() > 0 &&
+                         page_basis(page_size, page_anchors_, basis);
+    if (!calibration_valid_) {
+        return;
+    }
+    const double sx = target_rect.width() / page_size.width();
+    const double sy = target_rect.height() / page_size.height();
+    auto to_screen = [&](const QPointF &p) {
+        return QPointF(target_rect.left() + p.x() * sx, target_rect.top() + p.y() * sy);
+    };
+    origin_px_ = to_screen(basis[0]);
+    axis_x_px_ = to_screen(basis[1]);
+    axis_y_px_ = to_screen(basis[2]);
     const QPointF u = axis_x_px_ - origin_px_;
     const QPointF v = axis_y_px_ - origin_px_;
-    const double det = u.x() * v.y() - u.y() * v.x();
-    calibration_valid_ = std::abs(det) > 1e-6;
+    calibration_valid_ = std::abs(u.x() * v.y() - u.y() * v.x()) > 1e-6;
+}
+
+void pdfcanvas::draw_grid(QPainter &painter) {
+    if (!calibration_valid_ || grid_step_mm_ <= 0 || grid_extent_cm_ <= 0) {
+        return;
+    }
+
+    // Only the part of the grid inside the viewport is drawn.
+    const double half = static_cast<double>(grid_extent_cm_) / 2.0;
+    const QRectF view = QRectF(rect());
+    const QPointF corners[4] = {view.topLeft(), view.topRight(), view.bottomLeft(), view.bottomRight()};
+    double lo_x = std::numeric_limits<double>::max();
+    double lo_y = std::numeric_limits<double>::max();
+    double hi_x = std::numeric_limits<double>::lowest();
+    double hi_y = std::numeric_limits<double>::lowest();
+    for (const QPointF &corner : corners) {
+        QPointF world;
+        if (!screen_to_world(corner, world)) {
+            return;
+        }
+        lo_x = qMin(lo_x, world.x());
+        lo_y = qMin(lo_y, world.y());
+        hi_x = qMax(hi_x, world.x());
+        hi_y = qMax(hi_y, world.y());
+    }
+    lo_x = qMax(lo_x, -half);
+    lo_y = qMax(lo_y, -half);
+    hi_x = qMin(hi_x, half);
+    hi_y = qMin(hi_y, half);
+    if (lo_x > hi_x || lo_y > hi_y) {
+        return;
+    }
+
+    const QPointF u = axis_x_px_ - origin_px_;
+    const QPointF v = axis_y_px_ - origin_px_;
+    const double unit_px = qMin(std::hypot(u.x(), u.y()), std::hypot(v.x(), v.y()));
+    auto draw_lines = [&](double step, const QColor &color) {
+        if (step * unit_px < 4.0) {
+            return; // too dense to be readable
+        }
+        painter.setPen(QPen(color, 0));
+        for (double i = std::ceil(lo_x / step); i * step <= hi_x; i += 1.0) {
+            painter.drawLine(world_to_screen(i * step, lo_y), world_to_screen(i * step, hi_y));
+        }
+        for (double i = std::ceil(lo_y / step); i * step <= hi_y; i += 1.0) {
+            painter.drawLine(world_to_screen(lo_x, i * step), world_to_screen(hi_x, i * step));
+        }
+    };
+
+    painter.save();
+    painter.setRenderHint(QPainter::Antialiasing, false);
+    if (grid_step_mm_ != 10) {
+        draw_lines(static_cast<double>(grid_step_mm_) / 10.0, QColor(232, 232, 232));
+    }
+    draw_lines(1.0, QColor(207, 207, 207));
+    painter.setPen(QPen(QColor(191, 191, 191), 0));
+    if (lo_y <= 0.0 && hi_y >= 0.0) {
+        painter.drawLine(world_to_screen(lo_x, 0.0), world_to_screen(hi_x, 0.0));
+    }
+    if (lo_x <= 0.0 && hi_x >= 0.0) {
+        painter.drawLine(world_to_screen(0.0, lo_y), world_to_screen(0.0, hi_y));
+    }
+    painter.restore();
 }
 
 QPointF pdfcanvas::world_to_screen(double x, double y) const {
@@ -581,204 +994,156 @@ bool pdfcanvas::screen_to_world(const QPointF &p, QPointF &world_out) const {
     return true;
 }
 
-int pdfcanvas::hit_test_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(coordinates_.size()); ++i) {
-        const QPointF p = world_to_screen(coordinates_[i].x, coordinates_[i].y);
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-int pdfcanvas::hit_test_circle_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(circles_.size()); ++i) {
-        const circle_pair &c = circles_[i];
-        const QPointF p = world_to_screen(c.cx + c.r, c.cy); // 0 degree marker
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
-    }
-    return -1;
+double pdfcanvas::value_at(int row, int slot) const {
+    return row == drag_row_ ? drag_values_[slot] : primitives_->value[slot][row];
 }
 
-int pdfcanvas::hit_test_ellipse_rx_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(ellipses_.size()); ++i) {
-        const ellipse_pair &e = ellipses_[i];
-        const QPointF p = world_to_screen(e.cx + e.rx, e.cy);
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
+QPointF pdfcanvas::handle_point(int row, handle h) const {
+    if (h == handle::rectangle_corner) {
+        return world_to_screen(value_at(row, rectangle_slot::x2), value_at(row, rectangle_slot::y2));
     }
-    return -1;
-}
-
-int pdfcanvas::hit_test_ellipse_ry_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(ellipses_.size()); ++i) {
-        const ellipse_pair &e = ellipses_[i];
-        const QPointF p = world_to_screen(e.cx, e.cy + e.ry);
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
+    if (h == handle::circle_radius) {
+        // 0 degree marker
+        return world_to_screen(value_at(row, circle_slot::cx) + value_at(row, circle_slot::r),
+                               value_at(row, circle_slot::cy));
     }
-    return -1;
-}
-
-int pdfcanvas::hit_test_bezier_c1_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(beziers_.size()); ++i) {
-        const bezier_pair &b = beziers_[i];
-        const QPointF p = world_to_screen(b.x1, b.y1);
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-int pdfcanvas::hit_test_bezier_c2_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(beziers_.size()); ++i) {
-        const bezier_pair &b = beziers_[i];
-        const QPointF p = world_to_screen(b.x2, b.y2);
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
+    if (h == handle::ellipse_rx) {
+        return world_to_screen(value_at(row, ellipse_slot::cx) + value_at(row, ellipse_slot::rx),
+                               value_at(row, ellipse_slot::cy));
     }
-    return -1;
-}
-
-int pdfcanvas::hit_test_rectangle_marker(const QPointF &pos) const {
-    constexpr double threshold = 10.0;
-    for (int i = 0; i < static_cast<int>(rectangles_.size()); ++i) {
-        const rectangle_pair &r = rectangles_[i];
-        const QPointF p = world_to_screen(r.x2, r.y2); // draggable corner
-        if (QLineF(pos, p).length() <= threshold) {
-            return i;
-        }
+    if (h == handle::ellipse_ry) {
+        return world_to_screen(value_at(row, ellipse_slot::cx),
+                               value_at(row, ellipse_slot::cy) + value_at(row, ellipse_slot::ry));
     }
-    return -1;
-}
-
-void pdfcanvas::draw_coordinate_markers(QPainter &painter) {
-    if (!calibration_valid_ || coordinates_.empty()) {
-        return;
+    if (h == handle::bezier_c1) {
+        return world_to_screen(value_at(row, bezier_slot::x1), value_at(row, bezier_slot::y1));
     }
-
-    painter.save();
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    painter.setPen(QPen(QColor("#dc2626"), 2.0));
-    constexpr int half = 6;
-    for (const coord_pair &c : coordinates_) {
-        const QPointF p = world_to_screen(c.x, c.y);
-        painter.drawLine(QPointF(p.x() - half, p.y()), QPointF(p.x() + half, p.y()));
-        painter.drawLine(QPointF(p.x(), p.y() - half), QPointF(p.x(), p.y() + half));
+    if (h == handle::bezier_c2) {
+        return world_to_screen(value_at(row, bezier_slot::x2), value_at(row, bezier_slot::y2));
     }
-    painter.restore();
+    return world_to_screen(value_at(row, coordinate_slot::x), value_at(row, coordinate_slot::y));
 }
 
-void pdfcanvas::draw_circle_markers(QPainter &painter) {
-    if (!calibration_valid_ || circles_.empty()) {
-        return;
-    }
-
-    painter.save();
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    QPen dashed_pen(QColor(220, 38, 38, 150), 1.6, Qt::DashLine);
-    dashed_pen.setCosmetic(true);
-    painter.setPen(dashed_pen);
-    painter.setBrush(Qt::NoBrush);
-    constexpr int half = 5;
-    for (const circle_pair &c : circles_) {
-        const QPointF center = world_to_screen(c.cx, c.cy);
-        const QPointF handle = world_to_screen(c.cx + c.r, c.cy);
-        painter.drawLine(center, handle);
-        painter.drawLine(QPointF(handle.x() - half, handle.y()), QPointF(handle.x() + half, handle.y()));
-        painter.drawLine(QPointF(handle.x(), handle.y() - half), QPointF(handle.x(), handle.y() + half));
-        painter.drawEllipse(handle, 2.0, 2.0);
+void pdfcanvas::rebuild_handle_grid() {
+    handle_grid_.clear();
+    handle_grid_dirty_ = false;
+    handle_grid_basis_ = {origin_px_, axis_x_px_, axis_y_px_};
+    handle_grid_size_ = size();
+    // Clicks land inside the widget, so handles further out than the hit distance are left out.
+    const QRectF reach = QRectF(rect()).adjusted(-handle_hit_px, -handle_hit_px, handle_hit_px, handle_hit_px);
+    const primitive_table &table = *primitives_;
+    const auto add = [&](int row, handle h) {
+        const QPointF p = handle_point(row, h);
+        if (reach.contains(p)) {
+            handle_grid_.push_back({cell_key(handle_cell(p.x()), handle_cell(p.y())), row, h, p});
+        }
+    };
+    for (int row = 0; row < table.size(); ++row) {
+        const primitive_kind kind = table.kind[row];
+        if (kind == primitive_kind::rectangle) {
+            add(row, handle::rectangle_corner);
+        } else if (kind == primitive_kind::circle) {
+            add(row, handle::circle_radius);
+        } else if (kind == primitive_kind::ellipse) {
+            add(row, handle::ellipse_rx);
+            add(row, handle::ellipse_ry);
+        } else if (kind == primitive_kind::bezier) {
+            add(row, handle::bezier_c1);
+            add(row, handle::bezier_c2);
+        } else {
+            add(row, handle::coordinate);
+        }
     }
-    painter.restore();
+    std::sort(handle_grid_.begin(), handle_grid_.end(), [](const handle_entry &a, const handle_entry &b) {
+        return a.cell < b.cell;
+    });
 }
 
-void pdfcanvas::draw_rectangle_markers(QPainter &painter) {
-    if (!calibration_valid_ || rectangles_.empty()) {
-        return;
+// Of the handles within reach, the one earliest in `handle` wins, and between rows the earliest one.
+bool pdfcanvas::hit_test_handle(const QPointF &pos, int &row_out, handle &handle_out) {
+    const std::array<QPointF, 3> basis = {origin_px_, axis_x_px_, axis_y_px_};
+    if (handle_grid_dirty_ || basis != handle_grid_basis_ || size() != handle_grid_size_) {
+        rebuild_handle_grid();
     }
-
-    painter.save();
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    QPen dashed_pen(QColor(220, 38, 38, 150), 1.6, Qt::DashLine);
-    dashed_pen.setCosmetic(true);
-    painter.setPen(dashed_pen);
-    constexpr int half = 5;
-    for (const rectangle_pair &r : rectangles_) {
-        const QPointF p1 = world_to_screen(r.x1, r.y1);
-        const QPointF p2 = world_to_screen(r.x2, r.y2); // resize handle
-        painter.drawLine(p1, p2);
-        painter.drawLine(QPointF(p2.x() - half, p2.y()), QPointF(p2.x() + half, p2.y()));
-        painter.drawLine(QPointF(p2.x(), p2.y() - half), QPointF(p2.x(), p2.y() + half));
-        painter.drawEllipse(p2, 2.0, 2.0);
+    handle best = handle::none;
+    int best_row = -1;
+    const int cx = handle_cell(pos.x());
+    const int cy = handle_cell(pos.y());
+    for (int column = cx - 1; column <= cx + 1; ++column) {
+        const quint64 last = cell_key(column, cy + 1);
+        auto it = std::lower_bound(handle_grid_.begin(),
+                                   handle_grid_.end(),
+                                   cell_key(column, cy - 1),
+                                   [](const handle_entry &entry, quint64 key) { return entry.cell < key; });
+        for (; it != handle_grid_.end() && it->cell <= last; ++it) {
+            if ((it->h < best || (it->h == best && it->row < best_row)) &&
+                QLineF(pos, it->pos).length() <= handle_hit_px) {
+                best = it->h;
+                best_row = it->row;
+            }
+        }
     }
-    painter.restore();
+    row_out = best_row;
+    handle_out = best;
+    return best_row >= 0;
 }
 
-void pdfcanvas::draw_ellipse_markers(QPainter &painter) {
-    if (!calibration_valid_ || ellipses_.empty()) {
+void pdfcanvas::draw_markers(QPainter &painter) {
+    const primitive_table &table = *primitives_;
+    if (!calibration_valid_ || table.size() == 0) {
         return;
     }
 
     painter.save();
     painter.setRenderHint(QPainter::Antialiasing, true);
-    QPen dashed_pen(QColor(220, 38, 38, 150), 1.6, Qt::DashLine);
-    dashed_pen.setCosmetic(true);
-    painter.setPen(dashed_pen);
-    painter.setBrush(Qt::NoBrush);
-    constexpr int half = 5;
-    for (const ellipse_pair &e : ellipses_) {
-        const QPointF center = world_to_screen(e.cx, e.cy);
-        const QPointF hx = world_to_screen(e.cx + e.rx, e.cy);
-        const QPointF hy = world_to_screen(e.cx, e.cy + e.ry);
-        painter.drawLine(center, hx);
-        painter.drawLine(center, hy);
-        painter.drawLine(QPointF(hx.x() - half, hx.y()), QPointF(hx.x() + half, hx.y()));
-        painter.drawLine(QPointF(hx.x(), hx.y() - half), QPointF(hx.x(), hx.y() + half));
-        painter.drawLine(QPointF(hy.x() - half, hy.y()), QPointF(hy.x() + half, hy.y()));
-        painter.drawLine(QPointF(hy.x(), hy.y() - half), QPointF(hy.x(), hy.y() + half));
-        painter.drawEllipse(hx, 2.0, 2.0);
-        painter.drawEllipse(hy, 2.0, 2.0);
-    }
-    painter.restore();
-}
-
-void pdfcanvas::draw_bezier_markers(QPainter &painter) {
-    if (!calibration_valid_ || beziers_.empty()) {
-        return;
+    painter.setPen(QPen(QColor("#dc2626"), 2.0));
+    for (int row = 0; row < table.size(); ++row) {
+        if (table.kind[row] == primitive_kind::coordinate) {
+            draw_cross(painter, handle_point(row, handle::coordinate), 6.0);
+        }
     }
 
-    painter.save();
-    painter.setRenderHint(QPainter::Antialiasing, true);
     QPen dashed_pen(QColor(220, 38, 38, 150), 1.6, Qt::DashLine);
     dashed_pen.setCosmetic(true);
     painter.setPen(dashed_pen);
     painter.setBrush(Qt::NoBrush);
-    constexpr int half = 5;
-    for (const bezier_pair &b : beziers_) {
-        const QPointF p0 = world_to_screen(b.x0, b.y0);
-        const QPointF p1 = world_to_screen(b.x1, b.y1);
-        const QPointF p2 = world_to_screen(b.x2, b.y2);
-        const QPointF p3 = world_to_screen(b.x3, b.y3);
-        painter.drawLine(p0, p1);
-        painter.drawLine(p2, p3);
-        painter.drawLine(QPointF(p1.x() - half, p1.y()), QPointF(p1.x() + half, p1.y()));
-        painter.drawLine(QPointF(p1.x(), p1.y() - half), QPointF(p1.x(), p1.y() + half));
-        painter.drawLine(QPointF(p2.x() - half, p2.y()), QPointF(p2.x() + half, p2.y()));
-        painter.drawLine(QPointF(p2.x(), p2.y() - half), QPointF(p2.x(), p2.y() + half));
-        painter.drawEllipse(p1, 2.0, 2.0);
-        painter.drawEllipse(p2, 2.0, 2.0);
+    constexpr double half = 5.0;
+    for (int row = 0; row < table.size(); ++row) {
+        const primitive_kind kind = table.kind[row];
+        if (kind == primitive_kind::circle) {
+            const QPointF center = world_to_screen(value_at(row, circle_slot::cx), value_at(row, circle_slot::cy));
+            const QPointF h = handle_point(row, handle::circle_radius);
+            painter.drawLine(center, h);
+            draw_cross(painter, h, half);
+            painter.drawEllipse(h, 2.0, 2.0);
+        } else if (kind == primitive_kind::rectangle) {
+            const QPointF p1 = world_to_screen(value_at(row, rectangle_slot::x1), value_at(row, rectangle_slot::y1));
+            const QPointF p2 = handle_point(row, handle::rectangle_corner);
+            painter.drawLine(p1, p2);
+            draw_cross(painter, p2, half);
+            painter.drawEllipse(p2, 2.0, 2.0);
+        } else if (kind == primitive_kind::ellipse) {
+            const QPointF center = world_to_screen(value_at(row, ellipse_slot::cx), value_at(row, ellipse_slot::cy));
+            const QPointF hx = handle_point(row, handle::ellipse_rx);
+            const QPointF hy = handle_point(row, handle::ellipse_ry);
+            painter.drawLine(center, hx);
+            painter.drawLine(center, hy);
+            draw_cross(painter, hx, half);
+            draw_cross(painter, hy, half);
+            painter.drawEllipse(hx, 2.0, 2.0);
+            painter.drawEllipse(hy, 2.0, 2.0);
+        } else if (kind == primitive_kind::bezier) {
+            const QPointF p0 = world_to_screen(value_at(row, bezier_slot::x0), value_at(row, bezier_slot::y0));
+            const QPointF p1 = handle_point(row, handle::bezier_c1);
+            const QPointF p2 = handle_point(row, handle::bezier_c2);
+            const QPointF p3 = world_to_screen(value_at(row, bezier_slot::x3), value_at(row, bezier_slot::y3));
+            painter.drawLine(p0, p1);
+            painter.drawLine(p2, p3);
+            draw_cross(painter, p1, half);
+            draw_cross(painter, p2, half);
+            painter.drawEllipse(p1, 2.0, 2.0);
+            painter.drawEllipse(p2, 2.0, 2.0);
+        }
     }
     painter.restore();
 }
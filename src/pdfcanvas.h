@@ -1,38 +1,53 @@
 #ifndef PDFCANVAS_H
 #define PDFCANVAS_H
 
+#include <QCache>
 #include <QImage>
-#include <QPdfDocument>
 #include <QPointF>
+#include <QSet>
 #include <QSize>
+#include <QSizeF>
+#include <QThread>
 #include <QWidget>
+#include <array>
+#include <map>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "model.h"
+#include "pdfrenderworker.h"
+
+class QTimer;
 
 class pdfcanvas : public QWidget {
     Q_OBJECT
 
 public:
     explicit pdfcanvas(QWidget *parent = nullptr);
+    ~pdfcanvas() override;
 
-    void set_coordinates(const std::vector<coord_pair> &coords);
-    void set_circles(const std::vector<circle_pair> &circles);
-    void set_ellipses(const std::vector<ellipse_pair> &ellipses);
-    void set_beziers(const std::vector<bezier_pair> &beziers);
-    void set_rectangles(const std::vector<rectangle_pair> &rectangles);
+    void set_primitives(primitive_snapshot_ptr primitives);
     void set_snap_mm(int mm);
+    void set_grid(int step_mm, int extent_cm);
     void set_add_line_mode(bool enabled);
-    bool load_pdf(const QString &pdf_path);
+    void load_pdf(const QString &pdf_path, const page_anchors &anchors, quint64 compile_generation = 0);
+    // Whether the page on screen could be calibrated, so the grid and markers can be drawn over it.
+    bool has_calibration() const;
 
 signals:
+    void pdf_load_failed();
+    // The document loaded for compile_generation has replaced the one on screen.
+    void pdf_shown(quint64 compile_generation);
+    void phase_reached(quint64 compile_generation, int phase, qint64 timestamp_us);
     void add_point_clicked(double x, double y);
     void selection_changed(const QString &type, int index, int subindex);
-    void coordinate_dragged(int index, double x, double y);
-    void circle_radius_dragged(int index, double radius);
-    void ellipse_radii_dragged(int index, double rx, double ry);
-    void bezier_control_dragged(int index, int control_idx, double x, double y);
-    void rectangle_corner_dragged(int index, double x2, double y2);
+    // Dragged primitives are named by their stable id, which outlives the rows of any snapshot.
+    void coordinate_dragged(quint32 id, double x, double y);
+    void circle_radius_dragged(quint32 id, double radius);
+    void ellipse_radii_dragged(quint32 id, double rx, double ry);
+    void bezier_control_dragged(quint32 id, int control_idx, double x, double y);
+    void rectangle_corner_dragged(quint32 id, double x2, double y2);
 
 protected:
     void paintEvent(QPaintEvent *event) override;
@@ -42,55 +57,114 @@ protected:
     void mouseReleaseEvent(QMouseEvent *event) override;
 
 private:
+    // Draggable marker handles, in the order a click picks between overlapping ones.
+    enum class handle {
+        rectangle_corner,
+        circle_radius,
+        ellipse_rx,
+        ellipse_ry,
+        bezier_c1,
+        bezier_c2,
+        coordinate,
+        none
+    };
+
+    // A handle of primitives_ at its screen position, filed under the grid cell it lies in.
+    struct handle_entry {
+        quint64 cell = 0;
+        int row = -1;
+        handle h = handle::none;
+        QPointF pos;
+    };
+
     static bool is_near_color(int r, int g, int b, int tr, int tg, int tb, int max_dist_sq);
-    static std::vector<QPointF> find_color_centroids(const QImage &img, char target);
+    static void classify_marker_row(const QRgb *row, int x0, int x1, unsigned char *out);
+    static std::array<std::vector<QPointF>, 3> find_marker_centroids(const QImage &img, const QRect &window);
+    static bool pick_marker_triple(const std::array<std::vector<QPointF>, 3> &candidates,
+                                   QPointF &red_out,
+                                   QPointF &green_out,
+                                   QPointF &blue_out);
 
-    void update_calibration(const QRect &target_rect);
+    double fit_scale(const QSizeF &scene_size) const;
+    QRectF scene_rect(const QSizeF &page_size, const page_anchors &anchors) const;
+    QRect page_target_rect(const QSizeF &page_size, const page_anchors &anchors) const;
+    bool page_basis(const QSizeF &page_size, const page_anchors &anchors, QPointF basis_out[3]) const;
+    void on_document_loaded(quint64 document_generation, const QSizeF &page_size);
+    void on_load_failed(quint64 document_generation);
+    void on_first_frame_rendered(quint64 document_generation, const QImage &image);
+    void request_render(const QSize &size);
+    void on_page_rendered(quint64 generation, const QImage &image);
+    void on_tile_rendered(quint64 generation, const tile_key &key, const QImage &image);
+    void on_level_rendered(quint64 pyramid_generation, int level, const QImage &image);
+    void on_zoom_idle();
+    void request_pyramid_levels();
+    const QImage &backdrop_image(const QSize &overview_size) const;
+    std::vector<std::pair<QRect, const QImage *>> visible_tiles(const QRect &target_rect);
+    static QSize overview_size_for(const QSize &target_size);
+    void update_calibration();
+    void apply_calibration(const QRect &target_rect, const QSizeF &page_size);
+    void draw_grid(QPainter &painter);
     QPointF world_to_screen(double x, double y) const;
     bool screen_to_world(const QPointF &p, QPointF &world_out) const;
-    int hit_test_marker(const QPointF &pos) const;
-    int hit_test_circle_marker(const QPointF &pos) const;
-    int hit_test_ellipse_rx_marker(const QPointF &pos) const;
-    int hit_test_ellipse_ry_marker(const QPointF &pos) const;
-    int hit_test_bezier_c1_marker(const QPointF &pos) const;
-    int hit_test_bezier_c2_marker(const QPointF &pos) const;
-    int hit_test_rectangle_marker(const QPointF &pos) const;
-    void draw_coordinate_markers(QPainter &painter);
-    void draw_circle_markers(QPainter &painter);
-    void draw_ellipse_markers(QPainter &painter);
-    void draw_bezier_markers(QPainter &painter);
-    void draw_rectangle_markers(QPainter &painter);
+    double value_at(int row, int slot) const;
+    QPointF handle_point(int row, handle h) const;
+    void rebuild_handle_grid();
+    bool hit_test_handle(const QPointF &pos, int &row_out, handle &handle_out);
+    void draw_markers(QPainter &painter);
 
-    QPdfDocument pdf_document_;
+    QThread render_thread_;
+    pdfrenderworker *render_worker_ = nullptr;
+    quint64 document_generation_ = 0;
+    quint64 pending_document_generation_ = 0;
+    quint64 pending_compile_generation_ = 0;
+    QSizeF page_size_;
+    QSizeF pending_page_size_;
+    page_anchors pending_anchors_;
+    quint64 render_generation_ = 0;
+    quint64 shown_generation_ = 0;
+    QSize requested_size_;
     QImage rendered_image_;
-    QSize rendered_size_;
+    QSize tile_level_;
+    quint64 tile_generation_ = 0;
+    QCache<tile_key, QImage> tile_cache_;
+    QSet<tile_key> pending_tiles_;
+    std::map<int, QImage> pyramid_;
+    QSet<int> pending_levels_;
+    QSize pyramid_base_;
+    quint64 pyramid_generation_ = 0;
+    QTimer *zoom_idle_timer_ = nullptr;
+    bool zooming_ = false;
     double view_scale_ = 1.0;
     QPointF pan_offset_{0.0, 0.0};
     bool dragging_ = false;
     QPointF last_drag_pos_{0.0, 0.0};
-    bool marker_dragging_ = false;
-    int active_marker_index_ = -1;
-    bool circle_dragging_ = false;
-    int active_circle_index_ = -1;
-    bool ellipse_dragging_ = false;
-    int active_ellipse_index_ = -1;
-    bool ellipse_dragging_rx_ = true;
-    bool bezier_dragging_ = false;
-    int active_bezier_index_ = -1;
-    bool bezier_dragging_c1_ = true;
-    bool rectangle_dragging_ = false;
-    int active_rectangle_index_ = -1;
     bool add_line_mode_ = false;
-    std::vector<coord_pair> coordinates_;
-    std::vector<circle_pair> circles_;
-    std::vector<ellipse_pair> ellipses_;
-    std::vector<bezier_pair> beziers_;
-    std::vector<rectangle_pair> rectangles_;
+    primitive_snapshot_ptr primitives_ = std::make_shared<const primitive_table>();
+    // The row being dragged and its values, edited here until the source is rewritten; the table is shared.
+    // The id and kind find the row again when another snapshot is installed during the drag.
+    int drag_row_ = -1;
+    quint32 drag_id_ = 0;
+    primitive_kind drag_kind_ = primitive_kind::coordinate;
+    handle drag_handle_ = handle::none;
+    std::array<double, primitive_table::slot_count> drag_values_{};
+    // Handles within reach of the widget sorted by cell, built for the primitives, mapping and size below.
+    std::vector<handle_entry> handle_grid_;
+    bool handle_grid_dirty_ = true;
+    std::array<QPointF, 3> handle_grid_basis_;
+    QSize handle_grid_size_;
+    page_anchors page_anchors_;
+    bool image_calibration_valid_ = false;
+    QPointF image_origin_px_{0.0, 0.0};
+    QPointF image_axis_x_px_{1.0, 0.0};
+    QPointF image_axis_y_px_{0.0, -1.0};
+    QSize calibrated_image_size_;
     bool calibration_valid_ = false;
     QPointF origin_px_{0.0, 0.0};
     QPointF axis_x_px_{1.0, 0.0};
     QPointF axis_y_px_{0.0, -1.0};
     int snap_mm_ = 10;
+    int grid_step_mm_ = 10;
+    int grid_extent_cm_ = 20;
 };
 
 #endif
@@ -0,0 +1,103 @@
+#include "pdfrenderworker.h"
+
+#include <QFile>
+#include <QPdfDocumentRenderOptions>
+
+#include <utility>
+
+pdfrenderworker::pdfrenderworker(QObject *parent)
+    : QObject(parent),
+      current_document_(new QPdfDocument(this)),
+      current_buffer_(new QBuffer(this)),
+      pending_document_(new QPdfDocument(this)),
+      pending_buffer_(new QBuffer(this)) {
+    connect(current_document_, &QPdfDocument::statusChanged, this, &pdfrenderworker::on_pending_status_changed);
+    connect(pending_document_, &QPdfDocument::statusChanged, this, &pdfrenderworker::on_pending_status_changed);
+}
+
+void pdfrenderworker::set_latest_generation(quint64 generation) {
+    latest_generation_.store(generation);
+}
+
+void pdfrenderworker::set_latest_tile_generation(quint64 generation) {
+    latest_tile_generation_.store(generation);
+}
+
+bool pdfrenderworker::current_ready() const {
+    return current_document_->status() == QPdfDocument::Status::Ready && current_document_->pageCount() > 0;
+}
+
+void pdfrenderworker::load(quint64 document_generation, const QString &pdf_path) {
+    // Only the pending document is replaced; the current one keeps serving renders until the swap.
+    pending_generation_ = 0;
+    pending_document_->close();
+    pending_buffer_->close();
+
+    QFile file(pdf_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        pending_buffer_->setData(QByteArray());
+        emit load_failed(document_generation);
+        return;
+    }
+    pending_buffer_->setData(file.readAll());
+    pending_buffer_->open(QIODevice::ReadOnly);
+    pending_generation_ = document_generation;
+    pending_document_->load(pending_buffer_);
+}
+
+void pdfrenderworker::on_pending_status_changed(QPdfDocument::Status status) {
+    if (sender() != pending_document_ || pending_generation_ == 0) {
+        return;
+    }
+    const quint64 generation = pending_generation_;
+    if (status == QPdfDocument::Status::Ready && pending_document_->pageCount() > 0) {
+        emit document_loaded(generation, pending_document_->pagePointSize(0));
+    } else if (status == QPdfDocument::Status::Ready || status == QPdfDocument::Status::Error) {
+        pending_generation_ = 0;
+        emit load_failed(generation);
+    }
+}
+
+void pdfrenderworker::render_first_frame(quint64 document_generation, const QSize &size) {
+    if (document_generation != pending_generation_ ||
+        pending_document_->status() != QPdfDocument::Status::Ready || size.isEmpty()) {
+        return;
+    }
+    const QImage image = pending_document_->render(0, size);
+
+    std::swap(current_document_, pending_document_);
+    std::swap(current_buffer_, pending_buffer_);
+    pending_generation_ = 0;
+    pending_document_->close();
+    pending_buffer_->close();
+    pending_buffer_->setData(QByteArray());
+
+    emit first_frame_rendered(document_generation, image);
+}
+
+void pdfrenderworker::render(quint64 generation, const QSize &size) {
+    if (generation < latest_generation_.load() || !current_ready() || size.isEmpty()) {
+        return;
+    }
+    emit rendered(generation, current_document_->render(0, size));
+}
+
+void pdfrenderworker::render_level(quint64 pyramid_generation, int level, const QSize &size) {
+    if (!current_ready() || size.isEmpty()) {
+        return;
+    }
+    emit level_rendered(pyramid_generation, level, current_document_->render(0, size));
+}
+
+void pdfrenderworker::render_tile(quint64 generation, const tile_key &key, const QSize &page_size, const QRect &clip) {
+    if (generation < latest_tile_generation_.load() || !current_ready()) {
+        return;
+    }
+    if (key.page >= current_document_->pageCount() || clip.isEmpty()) {
+        return;
+    }
+    QPdfDocumentRenderOptions options;
+    options.setScaledSize(page_size);
+    options.setScaledClipRect(clip);
+    emit tile_rendered(generation, key, current_document_->render(key.page, clip.size(), options));
+}
@@ -0,0 +1,81 @@
+#ifndef PDFRENDERWORKER_H
+#define PDFRENDERWORKER_H
+
+#include <QBuffer>
+#include <QHash>
+#include <QImage>
+#include <QMetaType>
+#include <QObject>
+#include <QPdfDocument>
+#include <QRect>
+#include <QSize>
+#include <QSizeF>
+#include <QString>
+#include <atomic>
+
+// Identifies one fixed-size tile of a page rendered at a given scaled page size.
+struct tile_key {
+    int page = 0;
+    int level_width = 0;
+    int level_height = 0;
+    int tx = 0;
+    int ty = 0;
+};
+
+inline bool operator==(const tile_key &a, const tile_key &b) {
+    return a.page == b.page && a.level_width == b.level_width && a.level_height == b.level_height && a.tx == b.tx &&
+           a.ty == b.ty;
+}
+
+inline size_t qHash(const tile_key &key, size_t seed = 0) {
+    return qHashMulti(seed, key.page, key.level_width, key.level_height, key.tx, key.ty);
+}
+
+Q_DECLARE_METATYPE(tile_key)
+
+// Rasterizes PDF pages on a background thread. The worker holds the displayed document and, while
+// a recompiled PDF is loading, a pending one; each is loaded from an in-memory copy of the file so
+// later compiles may overwrite the PDF on disk. The pending document replaces the current one when
+// its first frame is rendered. Render requests carry a generation number; requests older than the
+// newest announced generation are dropped. Whole-page and tile requests are versioned
+// independently; zoom pyramid levels are never dropped here and are filtered by the canvas instead.
+class pdfrenderworker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit pdfrenderworker(QObject *parent = nullptr);
+
+    void set_latest_generation(quint64 generation);
+    void set_latest_tile_generation(quint64 generation);
+
+public slots:
+    void load(quint64 document_generation, const QString &pdf_path);
+    void render_first_frame(quint64 document_generation, const QSize &size);
+    void render(quint64 generation, const QSize &size);
+    void render_level(quint64 pyramid_generation, int level, const QSize &size);
+    void render_tile(quint64 generation, const tile_key &key, const QSize &page_size, const QRect &clip);
+
+signals:
+    void document_loaded(quint64 document_generation, const QSizeF &page_size);
+    void load_failed(quint64 document_generation);
+    void first_frame_rendered(quint64 document_generation, const QImage &image);
+    void rendered(quint64 generation, const QImage &image);
+    void level_rendered(quint64 pyramid_generation, int level, const QImage &image);
+    void tile_rendered(quint64 generation, const tile_key &key, const QImage &image);
+
+private slots:
+    void on_pending_status_changed(QPdfDocument::Status status);
+
+private:
+    bool current_ready() const;
+
+    QPdfDocument *current_document_ = nullptr;
+    QBuffer *current_buffer_ = nullptr;
+    QPdfDocument *pending_document_ = nullptr;
+    QBuffer *pending_buffer_ = nullptr;
+    quint64 pending_generation_ = 0;
+    std::atomic<quint64> latest_generation_{0};
+    std::atomic<quint64> latest_tile_generation_{0};
+};
+
+#endif
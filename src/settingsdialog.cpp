@@ -31,6 +31,9 @@ settingsdialog::settingsdialog(QWidget *parent) : QDialog(parent) {
     auto_compile_delay_spin_->setSuffix(" ms");
     auto_compile_delay_spin_->setValue(450);
 
+    adaptive_auto_compile_check_ = new QCheckBox("Adapt delay to typing speed and compile time", this);
+    adaptive_auto_compile_check_->setChecked(false);
+
     compiler_command_edit_ = new QLineEdit(this);
     compiler_command_edit_->setPlaceholderText("pdflatex");
     auto *compiler_browse_btn = new QPushButton("Browse...", this);
@@ -73,6 +76,7 @@ settingsdialog::settingsdialog(QWidget *parent) : QDialog(parent) {
     form->addRow("Editor font size", editor_font_size_spin_);
     form->addRow(QString(), show_line_numbers_check_);
     form->addRow("Auto-compile delay", auto_compile_delay_spin_);
+    form->addRow(QString(), adaptive_auto_compile_check_);
     form->addRow("LaTeX compiler", compiler_row);
     form->addRow("Grid/Snap step", grid_step_combo_);
     form->addRow("Grid extent", grid_extent_spin_);
@@ -122,6 +126,14 @@ int settingsdialog::auto_compile_delay_ms() const {
     return auto_compile_delay_spin_->value();
 }
 
+void settingsdialog::set_adaptive_auto_compile(bool enabled) {
+    adaptive_auto_compile_check_->setChecked(enabled);
+}
+
+bool settingsdialog::adaptive_auto_compile() const {
+    return adaptive_auto_compile_check_->isChecked();
+}
+
 void settingsdialog::set_compiler_command(const QString &command) {
     compiler_command_edit_->setText(command);
 }
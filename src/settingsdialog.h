@@ -24,6 +24,8 @@ public:
 
     void set_auto_compile_delay_ms(int value);
     int auto_compile_delay_ms() const;
+    void set_adaptive_auto_compile(bool enabled);
+    bool adaptive_auto_compile() const;
     void set_compiler_command(const QString &command);
     QString compiler_command() const;
 
@@ -40,6 +42,7 @@ private:
     QSpinBox *editor_font_size_spin_ = nullptr;
     QCheckBox *show_line_numbers_check_ = nullptr;
     QSpinBox *auto_compile_delay_spin_ = nullptr;
+    QCheckBox *adaptive_auto_compile_check_ = nullptr;
     QLineEdit *compiler_command_edit_ = nullptr;
     QComboBox *grid_step_combo_ = nullptr;
     QSpinBox *grid_extent_spin_ = nullptr;
@@ -0,0 +1,205 @@
+#include "sourcefingerprint.h"
+
+#include <QCryptographicHash>
+#include <QStringList>
+
+namespace {
+
+bool is_tex_letter(QChar c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool is_blank(QChar c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+} // namespace
+
+bool sourcefingerprint::is_verbatim_environment(const QString &name) {
+    static const QStringList names = {"verbatim",
+                                      "verbatim*",
+                                      "Verbatim",
+                                      "Verbatim*",
+                                      "BVerbatim",
+                                      "LVerbatim",
+                                      "lstlisting",
+                                      "minted",
+                                      "alltt",
+                                      "comment",
+                                      "filecontents",
+                                      "filecontents*"};
+    return names.contains(name);
+}
+
+int sourcefingerprint::verbatim_environment_end(const QString &source, int pos) {
+    const int n = static_cast<int>(source.size());
+    int k = pos;
+    while (k < n && is_blank(source.at(k))) {
+        ++k;
+    }
+    const int close = k < n && source.at(k) == '{' ? source.indexOf('}', k + 1) : -1;
+    if (close <= k) {
+        return -1;
+    }
+    const QString env = source.mid(k + 1, close - k - 1);
+    if (!is_verbatim_environment(env)) {
+        return -1;
+    }
+    const QString end_tag = "\\end{" + env + "}";
+    const int end = source.indexOf(end_tag, close + 1);
+    return end < 0 ? n : end + static_cast<int>(end_tag.size());
+}
+
+int sourcefingerprint::find_code(const QString &source, QStringView text, int from) {
+    const int n = static_cast<int>(source.size());
+    int i = qMax(0, from);
+    while (i < n) {
+        if (QStringView(source).mid(i).startsWith(text)) {
+            return i;
+        }
+        const QChar c = source.at(i);
+        if (c == '%') {
+            const int eol = source.indexOf('\n', i);
+            i = eol < 0 ? n : eol + 1;
+            continue;
+        }
+        if (c != '\\') {
+            ++i;
+            continue;
+        }
+        if (QStringView(source).mid(i + 1).startsWith(QLatin1String("begin"))) {
+            const int raw_end = verbatim_environment_end(source, i + 6);
+            if (raw_end > i) {
+                i = raw_end;
+                continue;
+            }
+        }
+        // An escaped character such as "\%" never starts a comment.
+        i += 2;
+    }
+    return -1;
+}
+
+QString sourcefingerprint::normalized(const QString &source) {
+    enum class gap { none, space, paragraph };
+
+    QString out;
+    out.reserve(source.size());
+    const int n = static_cast<int>(source.size());
+    gap pending = gap::none;
+    // Nothing but blanks seen on the current line yet; TeX skips them.
+    bool line_start = true;
+    // After a control word TeX skips blanks and one end of line, but a blank line is still a paragraph.
+    bool skip_spaces = false;
+
+    const auto emit_pending = [&]() {
+        if (pending == gap::paragraph) {
+            out += QStringLiteral("\n\n");
+        } else if (pending == gap::space) {
+            out += QLatin1Char(' ');
+        }
+        pending = gap::none;
+        line_start = false;
+        skip_spaces = false;
+    };
+
+    int i = 0;
+    while (i < n) {
+        const QChar c = source.at(i);
+        if (c == '\n') {
+            if (line_start) {
+                pending = gap::paragraph;
+            } else if (pending == gap::none && !skip_spaces) {
+                pending = gap::space;
+            }
+            line_start = true;
+            ++i;
+            continue;
+        }
+        if (is_blank(c)) {
+            if (!line_start && !skip_spaces && pending == gap::none) {
+                pending = gap::space;
+            }
+            ++i;
+            continue;
+        }
+        if (c == '%') {
+            // A comment also removes its end of line.
+            const int eol = source.indexOf('\n', i);
+            i = eol < 0 ? n : eol + 1;
+            line_start = true;
+            continue;
+        }
+        if (c != '\\') {
+            emit_pending();
+            out += c;
+            ++i;
+            continue;
+        }
+
+        emit_pending();
+        const int name_start = i + 1;
+        int j = name_start;
+        while (j < n && is_tex_letter(source.at(j))) {
+            ++j;
+        }
+        const bool control_word = j > name_start;
+        if (!control_word && j < n) {
+            ++j;
+        }
+        out += QStringView(source).mid(i, j - i);
+        i = j;
+        if (!control_word) {
+            // "\ " and a backslash at the end of a line behave like a control word.
+            const QChar symbol = i > name_start ? source.at(name_start) : QChar();
+            skip_spaces = symbol == ' ' || symbol == '\n';
+            line_start = symbol == '\n';
+            continue;
+        }
+        // One canonical space keeps "\foo bar" apart from "\foobar"; the blanks TeX skips are dropped.
+        out += QLatin1Char(' ');
+        skip_spaces = true;
+
+        const QStringView name = QStringView(source).mid(name_start, j - name_start);
+        int raw_end = -1;
+        if ((name == QLatin1String("verb") || name == QLatin1String("lstinline")) && i < n) {
+            int k = i;
+            if (name == QLatin1String("verb") && source.at(k) == '*') {
+                ++k;
+            }
+            if (k < n) {
+                const QChar open = source.at(k);
+                const QChar close = open == '{' ? QChar('}') : open;
+                const int end = source.indexOf(close, k + 1);
+                const int eol = source.indexOf('\n', k + 1);
+                raw_end = (end < 0 || (eol >= 0 && eol < end)) ? (eol < 0 ? n : eol) : end + 1;
+            }
+        } else if (name == QLatin1String("url") && i < n && source.at(i) == '{') {
+            int depth = 0;
+            for (int k = i; k < n; ++k) {
+                if (source.at(k) == '{') {
+                    ++depth;
+                } else if (source.at(k) == '}' && --depth == 0) {
+                    raw_end = k + 1;
+                    break;
+                }
+            }
+            if (raw_end < 0) {
+                raw_end = n;
+            }
+        } else if (name == QLatin1String("begin")) {
+            raw_end = verbatim_environment_end(source, i);
+        }
+        if (raw_end > i) {
+            out += QStringView(source).mid(i, raw_end - i);
+            i = raw_end;
+            skip_spaces = false;
+        }
+    }
+    return out;
+}
+
+QString sourcefingerprint::compute(const QString &source, const QString &compiler_command) {
+    const QByteArray input = (compiler_command + '\n' + normalized(source)).toUtf8();
+    return QString::fromLatin1(QCryptographicHash::hash(input, QCryptographicHash::Sha256).toHex());
+}
@@ -0,0 +1,22 @@
+#ifndef SOURCEFINGERPRINT_H
+#define SOURCEFINGERPRINT_H
+
+#include <QString>
+
+// Identifies sources that TeX would read the same way: comments are dropped and whitespace is
+// reduced to the space/paragraph distinction TeX makes. Verbatim-like text is kept as written.
+class sourcefingerprint {
+public:
+    static QString normalized(const QString &source);
+    static QString compute(const QString &source, const QString &compiler_command);
+    // First occurrence of text at or after from that TeX reads as code, skipping comments and
+    // verbatim-like environments; -1 if there is none. from must not lie inside a comment.
+    static int find_code(const QString &source, QStringView text, int from = 0);
+
+private:
+    static bool is_verbatim_environment(const QString &name);
+    // End of the verbatim-like environment whose "\begin" ends just before pos, or -1.
+    static int verbatim_environment_end(const QString &source, int pos);
+};
+
+#endif
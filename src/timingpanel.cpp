@@ -0,0 +1,82 @@
+#include "timingpanel.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileDialog>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QTableWidget>
+#include <QTextStream>
+#include <QVBoxLayout>
+
+#include "latencytracker.h"
+
+timingpanel::timingpanel(latencytracker *tracker, QWidget *parent)
+    : QDockWidget("Timing", parent), tracker_(tracker) {
+    setObjectName("timing_panel");
+
+    table_ = new QTableWidget(latencytracker::phase_count + 1, 5, this);
+    table_->setHorizontalHeaderLabels({"Phase", "p50 ms", "p95 ms", "Max ms", "Samples"});
+    table_->verticalHeader()->setVisible(false);
+    table_->horizontalHeader()->setSectionResizeMode(0, QHeaderView::Stretch);
+    table_->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    table_->setSelectionMode(QAbstractItemView::NoSelection);
+    for (int row = 0; row <= latencytracker::phase_count; ++row) {
+        const QString name = row < latencytracker::phase_count ? latencytracker::phase_name(row) : "Total";
+        table_->setItem(row, 0, new QTableWidgetItem(name));
+        for (int column = 1; column < 5; ++column) {
+            auto *item = new QTableWidgetItem;
+            item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            table_->setItem(row, column, item);
+        }
+    }
+
+    auto *export_btn = new QPushButton("Export CSV...", this);
+    auto *clear_btn = new QPushButton("Clear", this);
+    connect(export_btn, &QPushButton::clicked, this, &timingpanel::export_csv);
+    connect(clear_btn, &QPushButton::clicked, tracker_, &latencytracker::clear);
+    auto *button_row = new QHBoxLayout;
+    button_row->addStretch(1);
+    button_row->addWidget(clear_btn);
+    button_row->addWidget(export_btn);
+
+    auto *content = new QWidget(this);
+    auto *layout = new QVBoxLayout(content);
+    layout->setContentsMargins(6, 6, 6, 6);
+    layout->addWidget(table_, 1);
+    layout->addLayout(button_row);
+    setWidget(content);
+
+    connect(tracker_, &latencytracker::updated, this, &timingpanel::refresh);
+    refresh();
+}
+
+void timingpanel::refresh() {
+    // Each phase is timed from the previous phase its generation went through.
+    for (int row = 0; row <= latencytracker::phase_count; ++row) {
+        const latency_stats stats =
+            row < latencytracker::phase_count ? tracker_->phase_stats(row) : tracker_->total_stats();
+        const bool empty = stats.samples == 0;
+        table_->item(row, 1)->setText(empty ? "-" : QString::number(stats.p50_ms, 'f', 1));
+        table_->item(row, 2)->setText(empty ? "-" : QString::number(stats.p95_ms, 'f', 1));
+        table_->item(row, 3)->setText(empty ? "-" : QString::number(stats.max_ms, 'f', 1));
+        table_->item(row, 4)->setText(QString::number(stats.samples));
+    }
+}
+
+void timingpanel::export_csv() {
+    const QString path = QFileDialog::getSaveFileName(
+        this, "Export Timings", QDir::homePath() + "/timings.csv", "CSV files (*.csv);;All files (*)");
+    if (path.isEmpty()) {
+        return;
+    }
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        QMessageBox::warning(this, "Export failed", "Could not write file:\n" + path);
+        return;
+    }
+    QTextStream out(&file);
+    out << tracker_->to_csv();
+}
@@ -0,0 +1,26 @@
+#ifndef TIMINGPANEL_H
+#define TIMINGPANEL_H
+
+#include <QDockWidget>
+
+class QTableWidget;
+
+class latencytracker;
+
+// Dockable table of rolling per-phase latency percentiles, with CSV export of the raw samples.
+class timingpanel : public QDockWidget {
+    Q_OBJECT
+
+public:
+    explicit timingpanel(latencytracker *tracker, QWidget *parent = nullptr);
+
+private slots:
+    void refresh();
+    void export_csv();
+
+private:
+    latencytracker *tracker_ = nullptr;
+    QTableWidget *table_ = nullptr;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include <QRegularExpression>
+#include <QString>
+#include <QTest>
+#include <iterator>
+#include <random>
+
+#include "coordinateparser.h"
+
+namespace {
+
+// The patterns coordinateparser::parse() replaced; the lexer must find exactly what they find.
+#define NUMBER R"(([+-]?(?:\d+(?:\.\d+)?|\.\d+)(?:[eE][+-]?\d+)?))"
+#define PAIR R"(\(\s*)" NUMBER R"(\s*,\s*)" NUMBER R"(\s*\))"
+
+const QRegularExpression coordinate_pattern(PAIR);
+const QRegularExpression circle_pattern(PAIR R"(\s*circle\s*\(\s*)" NUMBER R"(\s*\))");
+const QRegularExpression ellipse_pattern(PAIR R"(\s*ellipse\s*\(\s*)" NUMBER R"(\s*and\s*)" NUMBER R"(\s*\))");
+const QRegularExpression rectangle_pattern(PAIR R"(\s*rectangle\s*)" PAIR);
+const QRegularExpression bezier_pattern(R"((?:)" PAIR R"(\s*)?\.\.\s*controls\s*)" PAIR R"(\s*and\s*)" PAIR
+                                        R"(\s*\.\.\s*)" PAIR);
+
+#undef PAIR
+#undef NUMBER
+
+// Pieces the random sources are built from: numbers at the limits of the exact conversion,
+// malformed numbers, blanks, keywords and complete primitives.
+const char *const source_tokens[] = {
+    "(", ")", ",", ", ", " ", "\n", "\t", "1", "2.5", ".5", "-3", "+4", "1e2", "1E-2", "e", ".", " .. ", "..",
+    "...", "controls", "and", "circle", "ellipse", "rectangle", ";", "1.", "x", "1e999", "123456789012345678901",
+    "0.1", "9007199254740993", "1e22", "1e23", "1.7976931348623157e308", "4.9e-324", "00000000000000000000012.5",
+    "(0,0)", "(1, 2)", " -- ", "(1,1) rectangle (2,2)", "(0,0) circle (1)", "(0,0) ellipse (2 and 1)",
+    ".. controls (1,2) and (3,4) .. (5,6)", "(7,8)"};
+
+QString describe(int start, int end, const QList<int> &span_starts, const QList<int> &span_ends,
+                 const QList<double> &values) {
+    QString line = QString::number(start) + "-" + QString::number(end);
+    for (qsizetype k = 0; k < primitive_table::slot_count; ++k) {
+        const bool used = k < values.size();
+        line += " " + QString::number(used ? span_starts[k] : -1) + ":" + QString::number(used ? span_ends[k] : -1) +
+                "=" + QString::number(used ? values[k] : 0.0, 'g', 17);
+    }
+    return line + "\n";
+}
+
+// Rows of one kind as the lexer reports them.
+QString lexed_rows(const primitive_table &table, primitive_kind kind) {
+    QString out;
+    for (int row = 0; row < table.size(); ++row) {
+        if (table.kind[row] != kind) {
+            continue;
+        }
+        QList<int> span_starts;
+        QList<int> span_ends;
+        QList<double> values;
+        for (int k = 0; k < primitive_table::slot_count; ++k) {
+            span_starts.append(table.span_start[k][row]);
+            span_ends.append(table.span_end[k][row]);
+            values.append(table.value[k][row]);
+        }
+        out += describe(table.start[row], table.end[row], span_starts, span_ends, values);
+    }
+    return out;
+}
+
+// Rows of one kind as the old per-kind scans produced them.
+QString expected_rows(const QString &source, primitive_kind kind) {
+    const QRegularExpression *pattern = &coordinate_pattern;
+    switch (kind) {
+    case primitive_kind::coordinate:
+        break;
+    case primitive_kind::circle:
+        pattern = &circle_pattern;
+        break;
+    case primitive_kind::ellipse:
+        pattern = &ellipse_pattern;
+        break;
+    case primitive_kind::bezier:
+        pattern = &bezier_pattern;
+        break;
+    case primitive_kind::rectangle:
+        pattern = &rectangle_pattern;
+        break;
+    }
+
+    QString out;
+    bool have_prev_end = false;
+    double prev_x3 = 0.0;
+    double prev_y3 = 0.0;
+    qsizetype last_seg_end = 0;
+    QRegularExpressionMatchIterator it = pattern->globalMatch(source);
+    while (it.hasNext()) {
+        const QRegularExpressionMatch m = it.next();
+        QList<int> span_starts;
+        QList<int> span_ends;
+        QList<double> values;
+        bool ok = true;
+        int first_group = 1;
+        if (kind == primitive_kind::bezier) {
+            // A segment without an explicit start continues from the previous one unless a ';'
+            // closed the path in between.
+            if (source.mid(last_seg_end, m.capturedStart(0) - last_seg_end).contains(';')) {
+                have_prev_end = false;
+            }
+            last_seg_end = m.capturedEnd(0);
+            if (!m.hasCaptured(1)) {
+                ok = have_prev_end;
+                span_starts << -1 << -1;
+                span_ends << -1 << -1;
+                values << prev_x3 << prev_y3;
+                first_group = 3;
+            }
+        }
+        for (int group = first_group; group <= m.lastCapturedIndex(); ++group) {
+            bool group_ok = false;
+            values.append(m.captured(group).toDouble(&group_ok));
+            ok = ok && group_ok;
+            span_starts.append(static_cast<int>(m.capturedStart(group)));
+            span_ends.append(static_cast<int>(m.capturedEnd(group)));
+        }
+        if (!ok) {
+            continue;
+        }
+        if (kind == primitive_kind::bezier) {
+            have_prev_end = true;
+            prev_x3 = values[6];
+            prev_y3 = values[7];
+        }
+        out += describe(static_cast<int>(m.capturedStart(0)), static_cast<int>(m.capturedEnd(0)), span_starts,
+                        span_ends, values);
+    }
+    return out;
+}
+
+} // namespace
+
+class tst_coordinateparser : public QObject {
+    Q_OBJECT
+
+private slots:
+    void lexer_matches_regex_scans();
+};
+
+void tst_coordinateparser::lexer_matches_regex_scans() {
+    const primitive_kind kinds[] = {primitive_kind::coordinate, primitive_kind::circle, primitive_kind::ellipse,
+                                    primitive_kind::bezier, primitive_kind::rectangle};
+    const int token_count = static_cast<int>(std::size(source_tokens));
+    std::mt19937 random(42);
+    for (int round = 0; round < 20000; ++round) {
+        QString source;
+        const int length = 5 + static_cast<int>(random() % 40);
+        for (int k = 0; k < length; ++k) {
+            source += QLatin1String(source_tokens[random() % token_count]);
+        }
+
+        const primitive_table table = coordinateparser::parse(source);
+        for (primitive_kind kind : kinds) {
+            const QString lexed = lexed_rows(table, kind);
+            const QString expected = expected_rows(source, kind);
+            if (lexed != expected) {
+                QFAIL(qPrintable("source: " + source + "\nlexer:\n" + lexed + "regex:\n" + expected));
+            }
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_coordinateparser)
+#include "tst_coordinateparser.moc"
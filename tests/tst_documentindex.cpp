@@ -0,0 +1,167 @@
+#include <QSet>
+#include <QString>
+#include <QTest>
+#include <algorithm>
+#include <iterator>
+#include <random>
+
+#include "coordinateparser.h"
+
+using coordinateparser::document_index;
+
+namespace {
+
+const char *const source_tokens[] = {"(1,2)", "( 3 , -4.5 )", " circle (2)", " ellipse (1 and 2)", " rectangle (5,6)",
+                                     " .. controls (1,1) and (2,2) .. (3,3)", "..", "controls", "(", ")", ",", ";",
+                                     ";\n", " ", "\\draw ", "and", "7", "1e3", ".5", "-"};
+const char edit_chars[] = "0123456789;.( ,)";
+
+QString random_tokens(std::mt19937 &random, int count) {
+    QString out;
+    for (int k = 0; k < count; ++k) {
+        out += QLatin1String(source_tokens[random() % std::size(source_tokens)]);
+    }
+    return out;
+}
+
+bool same_columns(const primitive_table &a, const primitive_table &b) {
+    if (a.kind != b.kind || a.start != b.start || a.end != b.end) {
+        return false;
+    }
+    for (int k = 0; k < primitive_table::slot_count; ++k) {
+        if (a.span_start[k] != b.span_start[k] || a.span_end[k] != b.span_end[k] || a.value[k] != b.value[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_statements(const document_index &a, const document_index &b) {
+    const std::vector<coordinateparser::statement_ref> &x = a.statements();
+    const std::vector<coordinateparser::statement_ref> &y = b.statements();
+    if (x.size() != y.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < x.size(); ++i) {
+        if (x[i].start != y[i].start || x[i].end != y[i].end || x[i].primitives.first != y[i].primitives.first ||
+            x[i].primitives.last != y[i].primitives.last) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The index must read exactly like a full parse of source.
+void verify_matches_full_parse(const document_index &index, const QString &source) {
+    document_index full;
+    full.reset(source);
+    const primitive_table &table = index.primitives();
+    QVERIFY2(same_columns(table, full.primitives()), qPrintable("primitives differ for: " + source));
+    QVERIFY2(same_statements(index, full), qPrintable("statements differ for: " + source));
+    QCOMPARE(index.length(), static_cast<int>(source.size()));
+    QVERIFY(std::is_sorted(table.start.begin(), table.start.end()));
+}
+
+// Ids are unique and non-zero, row_of() and kind_ordinal() agree with the rows, and ids that
+// were dropped no longer resolve.
+void verify_lookups(const document_index &index, const primitive_table &before) {
+    const primitive_table &table = index.primitives();
+    QCOMPARE(table.id.size(), table.kind.size());
+    QSet<quint32> live;
+    int kind_counts[static_cast<int>(primitive_kind::rectangle) + 1] = {};
+    for (int row = 0; row < table.size(); ++row) {
+        QVERIFY(table.id[row] != 0);
+        QVERIFY(!live.contains(table.id[row]));
+        live.insert(table.id[row]);
+        QCOMPARE(index.row_of(table.id[row]), row);
+        QCOMPARE(index.kind_ordinal(row), ++kind_counts[static_cast<int>(table.kind[row])]);
+    }
+    for (quint32 id : before.id) {
+        if (!live.contains(id)) {
+            QCOMPARE(index.row_of(id), -1);
+        }
+    }
+}
+
+} // namespace
+
+class tst_documentindex : public QObject {
+    Q_OBJECT
+
+private slots:
+    void incremental_edits_match_full_parse();
+};
+
+void tst_documentindex::incremental_edits_match_full_parse() {
+    std::mt19937 random(7);
+    for (int document = 0; document < 1500; ++document) {
+        QString source = random_tokens(random, static_cast<int>(random() % 60));
+        document_index index;
+        index.reset(source);
+        // Stands in for the index the background parse hands over.
+        document_index adopted;
+        adopted.reset(source);
+
+        for (int edit = 0; edit < 40; ++edit) {
+            int position = source.isEmpty() ? 0 : static_cast<int>(random() % (source.size() + 1));
+            int removed =
+                random() % 4 == 0 ? 0 : static_cast<int>(random() % qMin<qsizetype>(12, source.size() - position + 1));
+            QString inserted = random_tokens(random, static_cast<int>(random() % 3));
+            if (random() % 3 == 0) {
+                inserted.clear();
+                for (int k = static_cast<int>(random() % 3); k > 0; --k) {
+                    inserted += QLatin1Char(edit_chars[random() % (std::size(edit_chars) - 1)]);
+                }
+            }
+            // Replacing one digit by another keeps every primitive, and so every id.
+            bool digit_edit = false;
+            if (random() % 4 == 0 && !source.isEmpty()) {
+                for (int tries = 0; tries < 20; ++tries) {
+                    const int at = static_cast<int>(random() % source.size());
+                    if (source.at(at) >= QLatin1Char('1') && source.at(at) <= QLatin1Char('9')) {
+                        position = at;
+                        removed = 1;
+                        inserted = source.at(at) == QLatin1Char('8') ? QStringLiteral("9") : QStringLiteral("8");
+                        digit_edit = true;
+                        break;
+                    }
+                }
+            }
+
+            const primitive_table before = index.primitives();
+            source.replace(position, removed, inserted);
+            int start = 0;
+            int end = 0;
+            QVERIFY(index.affected_range(position, removed, static_cast<int>(inserted.size()), start, end));
+            index.apply_change(
+                position, removed, static_cast<int>(inserted.size()), QStringView(source).mid(start, end - start));
+
+            verify_matches_full_parse(index, source);
+            verify_lookups(index, before);
+            const primitive_table &table = index.primitives();
+            if (digit_edit && before.kind == table.kind) {
+                QVERIFY2(before.id == table.id, qPrintable("digit edit changed ids in: " + source));
+            }
+            // Rows before the re-lexed range are untouched.
+            for (size_t row = 0; row < before.kind.size() && row < table.kind.size() && before.start[row] < start;
+                 ++row) {
+                QCOMPARE(table.id[row], before.id[row]);
+            }
+
+            if (random() % 5 == 0) {
+                document_index parsed;
+                parsed.reset(source);
+                const primitive_table adopted_before = adopted.primitives();
+                adopted.adopt(std::move(parsed));
+                verify_matches_full_parse(adopted, source);
+                verify_lookups(adopted, adopted_before);
+            }
+            if (QTest::currentTestFailed()) {
+                return;
+            }
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(tst_documentindex)
+#include "tst_documentindex.moc"